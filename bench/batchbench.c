@@ -0,0 +1,235 @@
+/*
+ * batchbench - per-event cost of draining receiver events in batches
+ *
+ * The daemon drains the receiver queue up to EVENT_BATCH events per
+ * wakeup: it fetches the reports into an array, drops unchanged ones and
+ * decodes the rest in tight loops, logs each one, and stages the sink
+ * tasks, which are published with one flush, one lock round trip and one
+ * worker wakeup per batch. This benchmark runs the same steps on a model
+ * of the pipeline: an event source behind a function pointer (like
+ * getNextEvent), a cookie table, a stdio log to /dev/null and a sink ring
+ * drained by a worker thread.
+ *
+ * A drain can never take more events than the kernel queue holds, so the
+ * batch sizes that matter are 1 (one event per wakeup, as before batching),
+ * 8 (the receiver queue depth before it was raised) and 32 (EVENT_BATCH,
+ * with the queue as deep). Reported are nanoseconds per event.
+ *
+ * Build and run:
+ *
+ *   gcc -O2 -Wall -o batchbench bench/batchbench.c -lpthread
+ *   ./batchbench [EVENTS]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_EVENTS (1 << 20)
+#define QUEUE_DEPTH    64               // SINK_QUEUE_DEPTH
+#define COOKIES        64
+#define NBUTTONS       6
+
+typedef struct event
+{
+    uint32_t cookie;
+    int32_t  value;
+    uint64_t timestamp;
+} event_t;
+
+typedef struct task
+{
+    uint64_t trace;
+    uint32_t action;
+} task_t;
+
+uint64_t        now(void);
+int             nextEvent(event_t *event);
+void           *workerMain(void *arg);
+void            publish(task_t *staged, int count);
+uint64_t        run(int batch, size_t n);
+
+static event_t        *events;
+static size_t          eventCount, eventNext;
+static int             cookieButtons[COOKIES];
+static int32_t         cookieValues[COOKIES];
+static FILE           *logFile;
+static uint64_t        trace;
+
+static task_t          ring[QUEUE_DEPTH];
+static unsigned int    ringHead, ringCount;
+static int             scheduled, stopping;
+static uint64_t        executed;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  space = PTHREAD_COND_INITIALIZER;
+
+uint64_t
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Returns 0 like getNextEvent, or 1 once the queue is empty.
+ */
+int
+nextEvent(event_t *event)
+{
+    if (eventNext == eventCount)
+        return 1;
+    *event = events[eventNext++];
+    return 0;
+}
+
+static int (*volatile getNext)(event_t *event) = nextEvent;
+
+/*
+ * Stands in for the sink worker: takes all queued tasks at once, then
+ * sleeps until the next publish schedules it again.
+ */
+void *
+workerMain(void *arg)
+{
+    unsigned int count;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!ringCount && !stopping)
+            pthread_cond_wait(&wakeup, &lock);
+        if (!ringCount)
+            break;
+        count = ringCount;
+        ringHead = (ringHead + count) % QUEUE_DEPTH;
+        ringCount = 0;
+        executed += count;
+        pthread_cond_signal(&space);
+        pthread_mutex_unlock(&lock);
+        pthread_mutex_lock(&lock);
+        if (!ringCount)
+            scheduled = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+void
+publish(task_t *staged, int count)
+{
+    int i, schedule = 0;
+
+    fflush(logFile);
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < count; i++) {
+        // the daemon drops what does not fit; here the worker catches up
+        while (ringCount == QUEUE_DEPTH)
+            pthread_cond_wait(&space, &lock);
+        ring[(ringHead + ringCount++) % QUEUE_DEPTH] = staged[i];
+    }
+    if (ringCount && !scheduled)
+        schedule = scheduled = 1;
+    pthread_mutex_unlock(&lock);
+    if (schedule)
+        pthread_cond_signal(&wakeup);
+}
+
+uint64_t
+run(int batch, size_t n)
+{
+    event_t   fetched[64];
+    task_t    staged[64];
+    int       buttons[64];
+    uint64_t  start;
+    pthread_t worker;
+    int       i, k, count;
+
+    eventNext = 0;
+    executed = 0;
+    stopping = 0;
+    memset(cookieValues, 0xff, sizeof(cookieValues));
+    pthread_create(&worker, NULL, workerMain, NULL);
+
+    start = now();
+    for (;;) {
+        for (count = 0; count < batch; count++)
+            if (getNext(&fetched[count]))
+                break;
+        if (count == 0)
+            break;
+        for (i = k = 0; i < count; i++) {
+            if (cookieValues[fetched[i].cookie] == fetched[i].value)
+                continue;
+            cookieValues[fetched[i].cookie] = fetched[i].value;
+            fetched[k++] = fetched[i];
+        }
+        for (i = 0; i < k; i++)
+            buttons[i] = cookieButtons[fetched[i].cookie];
+        for (i = count = 0; i < k; i++) {
+            fprintf(logFile, "%#x %s (trace %llu)\n", fetched[i].cookie,
+                    fetched[i].value ? "pressed" : "depressed",
+                    (unsigned long long)++trace);
+            if (fetched[i].value && buttons[i] >= 0) {
+                staged[count].trace = trace;
+                staged[count++].action = 123 + buttons[i];
+            }
+        }
+        publish(staged, count);
+    }
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+    pthread_join(worker, NULL);
+    return now() - start;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int batches[] = { 1, 8, 32 };
+    uint64_t         elapsed, base = 0;
+    size_t           n = DEFAULT_EVENTS, i;
+    int              b;
+
+    if (argc > 1)
+        n = strtoul(argv[1], NULL, 10);
+    if (n == 0) {
+        fprintf(stderr, "usage: %s [EVENTS]\n", argv[0]);
+        exit(1);
+    }
+    if ((logFile = fopen("/dev/null", "w")) == NULL) {
+        perror("/dev/null");
+        exit(1);
+    }
+
+    // presses and releases of the six buttons, as the receiver reports them
+    for (i = 0; i < COOKIES; i++)
+        cookieButtons[i] = (i >= 20 && i < 20 + NBUTTONS) ? i - 20 : -1;
+    if ((events = calloc(n, sizeof(*events))) == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        events[i].cookie = 20 + (i / 2 * 7919) % NBUTTONS;
+        events[i].value = !(i & 1);
+        events[i].timestamp = i;
+    }
+    eventCount = n;
+
+    for (b = 0; b < (int)(sizeof(batches) / sizeof(batches[0])); b++) {
+        elapsed = run(batches[b], n);
+        if (!base)
+            base = elapsed;
+        printf("batch %2d  %7.1f ns/event  %5.2fx  (%llu tasks run)\n",
+               batches[b], (double)elapsed / n, (double)base / elapsed,
+               (unsigned long long)executed);
+    }
+    return 0;
+}
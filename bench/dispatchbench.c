@@ -0,0 +1,551 @@
+/*
+ * dispatchbench - compare lookup structures for button and key dispatch
+ *
+ * The daemon maps a handful of HID cookies to buttons. Imported code
+ * libraries (learned IR codes, lircd configurations) can bring tens of
+ * thousands of codes, so this benchmark measures the candidate structures
+ * on key sets from 6 to 100k entries:
+ *
+ *   chain    a linear chain of compares, as in the original callback
+ *   dense    an array indexed by key - min key
+ *   sorted   a sorted array searched by bisection
+ *   open     open addressing with linear probing, load factor 1/2
+ *   perfect  a minimal perfect hash (hash and displace), keys verified
+ *
+ * Keys are drawn like real codes: runs of consecutive usages on a few
+ * usage pages. Lookups follow a skewed distribution (a few keys are hit
+ * most of the time) and one in ten looks up an absent key. For every
+ * structure the benchmark reports nanoseconds per lookup, cache misses per
+ * lookup (from the hardware counters, on Linux only) and the memory it
+ * occupies.
+ *
+ * Build and run:
+ *
+ *   gcc -O2 -Wall -o dispatchbench bench/dispatchbench.c
+ *   ./dispatchbench [LOOKUPS]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define DEFAULT_LOOKUPS (1 << 22)
+#define CHAIN_MAX       4096            // longer chains take too long
+#define DENSE_MAX       (1 << 24)       // largest dense key range
+#define MISSING         0xffffffffu
+
+typedef struct table
+{
+    const char *name;
+    void      (*build)(struct table *t, const uint32_t *keys, size_t n);
+    uint32_t  (*lookup)(const struct table *t, uint32_t key);
+    void      (*destroy)(struct table *t);
+    size_t      bytes;
+    size_t      n;
+    uint32_t    base;
+    uint32_t    mask;
+    uint32_t   *keys;
+    uint32_t   *values;
+    uint32_t   *displace;
+    size_t      buckets;
+} table_t;
+
+uint64_t        now(void);
+uint32_t        mix(uint32_t key, uint32_t seed);
+uint64_t        nextRandom(void);
+int             compareKeys(const void *a, const void *b);
+int             comparePairs(const void *a, const void *b);
+int             compareBuckets(const void *a, const void *b);
+void            makeKeys(uint32_t *keys, size_t n);
+void            makeLookups(uint32_t *lookups, size_t count,
+                            const uint32_t *keys, size_t n);
+void            chainBuild(table_t *t, const uint32_t *keys, size_t n);
+uint32_t        chainLookup(const table_t *t, uint32_t key);
+void            denseBuild(table_t *t, const uint32_t *keys, size_t n);
+uint32_t        denseLookup(const table_t *t, uint32_t key);
+void            sortedBuild(table_t *t, const uint32_t *keys, size_t n);
+uint32_t        sortedLookup(const table_t *t, uint32_t key);
+void            openBuild(table_t *t, const uint32_t *keys, size_t n);
+uint32_t        openLookup(const table_t *t, uint32_t key);
+void            perfectBuild(table_t *t, const uint32_t *keys, size_t n);
+uint32_t        perfectLookup(const table_t *t, uint32_t key);
+void            tableDestroy(table_t *t);
+int             cacheCounterOpen(void);
+uint64_t        cacheCounterRead(int fd);
+void           *xcalloc(size_t count, size_t size);
+
+static table_t tables[] = {
+    { "chain",   chainBuild,   chainLookup,   tableDestroy },
+    { "dense",   denseBuild,   denseLookup,   tableDestroy },
+    { "sorted",  sortedBuild,  sortedLookup,  tableDestroy },
+    { "open",    openBuild,    openLookup,    tableDestroy },
+    { "perfect", perfectBuild, perfectLookup, tableDestroy },
+};
+
+#define NTABLES (sizeof(tables) / sizeof(tables[0]))
+
+static const size_t keyCounts[] = {
+    6, 16, 64, 256, 1024, 4096, 16384, 65536, 100000
+};
+
+static uint64_t randomState = 0x9e3779b97f4a7c15ULL;
+
+uint64_t
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t
+nextRandom(void)
+{
+    // xorshift64*
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return randomState * 0x2545f4914f6cdd1dULL;
+}
+
+uint32_t
+mix(uint32_t key, uint32_t seed)
+{
+    key ^= seed;
+    key ^= key >> 16;
+    key *= 0x7feb352du;
+    key ^= key >> 15;
+    key *= 0x846ca68bu;
+    key ^= key >> 16;
+    return key;
+}
+
+int
+compareKeys(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+int
+comparePairs(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static const uint32_t *bucketSizes;    // for compareBuckets
+
+int
+compareBuckets(const void *a, const void *b)
+{
+    uint32_t x = bucketSizes[*(const uint32_t *)a];
+    uint32_t y = bucketSizes[*(const uint32_t *)b];
+
+    return (x < y) - (x > y);
+}
+
+void *
+xcalloc(size_t count, size_t size)
+{
+    void *p;
+
+    if ((p = calloc(count ? count : 1, size)) == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * Distinct keys of the form page << 16 | usage, in runs of up to 64
+ * consecutive usages, shuffled.
+ */
+void
+makeKeys(uint32_t *keys, size_t n)
+{
+    size_t   i = 0, j, run;
+    uint32_t page, usage, tmp;
+
+    while (i < n) {
+        page = 1 + nextRandom() % 255;
+        usage = nextRandom() % 0xffc0;
+        run = 1 + nextRandom() % 64;
+        for (j = 0; j < run && i < n; j++, i++)
+            keys[i] = page << 16 | (usage + (uint32_t)j);
+        if (i == n) {
+            // runs may overlap; drop duplicates and refill
+            qsort(keys, n, sizeof(*keys), compareKeys);
+            for (i = j = 1; j < n; j++)
+                if (keys[j] != keys[i - 1])
+                    keys[i++] = keys[j];
+        }
+    }
+    for (i = n - 1; i > 0; i--) {
+        j = nextRandom() % (i + 1);
+        tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+/*
+ * Skewed lookups: half go to the first eighth of the keys, the rest are
+ * spread over all keys, and one in ten misses.
+ */
+void
+makeLookups(uint32_t *lookups, size_t count, const uint32_t *keys, size_t n)
+{
+    size_t   i;
+    uint64_t r;
+
+    for (i = 0; i < count; i++) {
+        r = nextRandom();
+        if (r % 10 == 0)
+            lookups[i] = (uint32_t)(r >> 32) | 0x01000000u; // page > 255
+        else if (r & 16)
+            lookups[i] = keys[(r >> 8) % (n / 8 + 1)];
+        else
+            lookups[i] = keys[(r >> 8) % n];
+    }
+}
+
+/*
+ * Values are key indices, so every structure returns the same answers and
+ * the checksums can be compared.
+ */
+void
+chainBuild(table_t *t, const uint32_t *keys, size_t n)
+{
+    t->keys = xcalloc(n, sizeof(*t->keys));
+    memcpy(t->keys, keys, n * sizeof(*keys));
+    t->n = n;
+    t->bytes = n * sizeof(*t->keys);
+}
+
+uint32_t
+chainLookup(const table_t *t, uint32_t key)
+{
+    size_t i;
+
+    for (i = 0; i < t->n; i++)
+        if (t->keys[i] == key)
+            return (uint32_t)i;
+    return MISSING;
+}
+
+void
+denseBuild(table_t *t, const uint32_t *keys, size_t n)
+{
+    uint32_t lo = keys[0], hi = keys[0];
+    size_t   i, range;
+
+    for (i = 1; i < n; i++) {
+        if (keys[i] < lo)
+            lo = keys[i];
+        if (keys[i] > hi)
+            hi = keys[i];
+    }
+    range = (size_t)(hi - lo) + 1;
+    t->values = xcalloc(range, sizeof(*t->values));
+    memset(t->values, 0xff, range * sizeof(*t->values));
+    for (i = 0; i < n; i++)
+        t->values[keys[i] - lo] = (uint32_t)i;
+    t->base = lo;
+    t->n = range;
+    t->bytes = range * sizeof(*t->values);
+}
+
+uint32_t
+denseLookup(const table_t *t, uint32_t key)
+{
+    key -= t->base;
+    return (key < t->n) ? t->values[key] : MISSING;
+}
+
+void
+sortedBuild(table_t *t, const uint32_t *keys, size_t n)
+{
+    uint64_t *pairs;
+    size_t    i;
+
+    // sort key/index pairs together
+    pairs = xcalloc(n, sizeof(*pairs));
+    for (i = 0; i < n; i++)
+        pairs[i] = (uint64_t)keys[i] << 32 | i;
+    qsort(pairs, n, sizeof(*pairs), comparePairs);
+    t->keys = xcalloc(n, sizeof(*t->keys));
+    t->values = xcalloc(n, sizeof(*t->values));
+    for (i = 0; i < n; i++) {
+        t->keys[i] = (uint32_t)(pairs[i] >> 32);
+        t->values[i] = (uint32_t)pairs[i];
+    }
+    free(pairs);
+    t->n = n;
+    t->bytes = n * (sizeof(*t->keys) + sizeof(*t->values));
+}
+
+uint32_t
+sortedLookup(const table_t *t, uint32_t key)
+{
+    size_t lo = 0, hi = t->n, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (t->keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < t->n && t->keys[lo] == key) ? t->values[lo] : MISSING;
+}
+
+void
+openBuild(table_t *t, const uint32_t *keys, size_t n)
+{
+    size_t   size = 4, i;
+    uint32_t slot;
+
+    while (size < 2 * n)
+        size *= 2;
+    t->keys = xcalloc(size, sizeof(*t->keys));
+    t->values = xcalloc(size, sizeof(*t->values));
+    memset(t->values, 0xff, size * sizeof(*t->values));
+    t->mask = (uint32_t)(size - 1);
+    for (i = 0; i < n; i++) {
+        slot = mix(keys[i], 0) & t->mask;
+        while (t->values[slot] != MISSING)
+            slot = (slot + 1) & t->mask;
+        t->keys[slot] = keys[i];
+        t->values[slot] = (uint32_t)i;
+    }
+    t->n = size;
+    t->bytes = size * (sizeof(*t->keys) + sizeof(*t->values));
+}
+
+uint32_t
+openLookup(const table_t *t, uint32_t key)
+{
+    uint32_t slot = mix(key, 0) & t->mask;
+
+    while (t->values[slot] != MISSING) {
+        if (t->keys[slot] == key)
+            return t->values[slot];
+        slot = (slot + 1) & t->mask;
+    }
+    return MISSING;
+}
+
+/*
+ * Hash and displace: keys are grouped into n/4 buckets by a first hash.
+ * Buckets are placed largest first; for each one, displacement seeds are
+ * tried until all of its keys land on free slots under the second hash.
+ * A lookup is two hashes and one probe, plus a key compare to reject
+ * absent keys.
+ */
+void
+perfectBuild(table_t *t, const uint32_t *keys, size_t n)
+{
+    size_t    buckets = n / 4 + 1, i, j, k;
+    uint32_t *order, *sizes, *members, *starts, *fill, seed;
+    uint32_t  slots[64];
+    char     *used;
+
+    sizes = xcalloc(buckets, sizeof(*sizes));
+    for (i = 0; i < n; i++)
+        sizes[mix(keys[i], 1) % buckets]++;
+    starts = xcalloc(buckets + 1, sizeof(*starts));
+    for (i = 0; i < buckets; i++)
+        starts[i + 1] = starts[i] + sizes[i];
+    fill = xcalloc(buckets, sizeof(*fill));
+    members = xcalloc(n, sizeof(*members));
+    for (i = 0; i < n; i++) {
+        j = mix(keys[i], 1) % buckets;
+        members[starts[j] + fill[j]++] = (uint32_t)i;
+    }
+
+    // place the largest buckets first, while most slots are free
+    order = xcalloc(buckets, sizeof(*order));
+    for (i = 0; i < buckets; i++)
+        order[i] = (uint32_t)i;
+    bucketSizes = sizes;
+    qsort(order, buckets, sizeof(*order), compareBuckets);
+
+    t->keys = xcalloc(n, sizeof(*t->keys));
+    t->values = xcalloc(n, sizeof(*t->values));
+    t->displace = xcalloc(buckets, sizeof(*t->displace));
+    used = xcalloc(n, 1);
+    for (k = 0; k < buckets && sizes[order[k]]; k++) {
+        j = order[k];
+        if (sizes[j] > 64) {
+            fprintf(stderr, "perfect: bucket too large\n");
+            exit(1);
+        }
+        for (seed = 2; ; seed++) {
+            for (i = 0; i < sizes[j]; i++) {
+                slots[i] = mix(keys[members[starts[j] + i]], seed) % n;
+                if (used[slots[i]])
+                    break;
+                used[slots[i]] = 1;
+            }
+            if (i == sizes[j])
+                break;
+            while (i-- > 0)
+                used[slots[i]] = 0;
+        }
+        t->displace[j] = seed;
+        for (i = 0; i < sizes[j]; i++) {
+            t->keys[slots[i]] = keys[members[starts[j] + i]];
+            t->values[slots[i]] = members[starts[j] + i];
+        }
+    }
+
+    free(used);
+    free(order);
+    free(members);
+    free(fill);
+    free(starts);
+    free(sizes);
+    t->n = n;
+    t->buckets = buckets;
+    t->bytes = n * (sizeof(*t->keys) + sizeof(*t->values)) +
+               buckets * sizeof(*t->displace);
+}
+
+uint32_t
+perfectLookup(const table_t *t, uint32_t key)
+{
+    uint32_t seed = t->displace[mix(key, 1) % t->buckets], slot;
+
+    if (seed == 0)
+        return MISSING;
+    slot = mix(key, seed) % t->n;
+    return (t->keys[slot] == key) ? t->values[slot] : MISSING;
+}
+
+void
+tableDestroy(table_t *t)
+{
+    free(t->keys);
+    free(t->values);
+    free(t->displace);
+    t->keys = t->values = t->displace = NULL;
+}
+
+/*
+ * Last-level cache misses of this thread, or -1 where the counter is not
+ * available (not Linux, or perf events are restricted).
+ */
+int
+cacheCounterOpen(void)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+uint64_t
+cacheCounterRead(int fd)
+{
+    uint64_t value = 0;
+
+#ifdef __linux__
+    if (fd >= 0 && read(fd, &value, sizeof(value)) != sizeof(value))
+        value = 0;
+#endif
+    return value;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t    lookupCount = DEFAULT_LOOKUPS, k, i, n;
+    uint32_t *keys, *lookups;
+    uint64_t  start, elapsed, misses0, misses1, sum, reference = 0;
+    int       counter, haveReference;
+    unsigned  t;
+    char      missText[32];
+
+    if (argc > 1 && (lookupCount = strtoul(argv[1], NULL, 10)) == 0) {
+        fprintf(stderr, "usage: %s [LOOKUPS]\n", argv[0]);
+        exit(1);
+    }
+    counter = cacheCounterOpen();
+    keys = xcalloc(keyCounts[sizeof(keyCounts) / sizeof(keyCounts[0]) - 1],
+                   sizeof(*keys));
+    lookups = xcalloc(lookupCount, sizeof(*lookups));
+
+    printf("%-8s %7s %10s %12s %12s\n", "table", "keys", "ns/lookup",
+           "misses/look", "bytes");
+    for (k = 0; k < sizeof(keyCounts) / sizeof(keyCounts[0]); k++) {
+        n = keyCounts[k];
+        makeKeys(keys, n);
+        makeLookups(lookups, lookupCount, keys, n);
+        haveReference = 0;
+
+        for (t = 0; t < NTABLES; t++) {
+            table_t *table = &tables[t];
+
+            if (table->build == chainBuild && n > CHAIN_MAX) {
+                printf("%-8s %7zu %10s\n", table->name, n, "skipped");
+                continue;
+            }
+            table->build(table, keys, n);
+            if (table->build == denseBuild && table->n > DENSE_MAX) {
+                printf("%-8s %7zu %10s (range %zu)\n", table->name, n,
+                       "skipped", table->n);
+                table->destroy(table);
+                continue;
+            }
+
+            // warm up, then measure
+            for (i = 0, sum = 0; i < lookupCount && i < 4096; i++)
+                sum += table->lookup(table, lookups[i]);
+            misses0 = cacheCounterRead(counter);
+            start = now();
+            for (i = 0, sum = 0; i < lookupCount; i++)
+                sum += table->lookup(table, lookups[i]);
+            elapsed = now() - start;
+            misses1 = cacheCounterRead(counter);
+
+            if (!haveReference) {
+                reference = sum;
+                haveReference = 1;
+            } else if (sum != reference)
+                fprintf(stderr, "%s: checksum mismatch at %zu keys\n",
+                        table->name, n);
+            if (counter >= 0)
+                snprintf(missText, sizeof(missText), "%.3f",
+                         (double)(misses1 - misses0) / lookupCount);
+            else
+                snprintf(missText, sizeof(missText), "n/a");
+            printf("%-8s %7zu %10.2f %12s %12zu\n", table->name, n,
+                   (double)elapsed / lookupCount, missText, table->bytes);
+            table->destroy(table);
+        }
+    }
+
+    free(lookups);
+    free(keys);
+    return 0;
+}
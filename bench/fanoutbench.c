@@ -0,0 +1,208 @@
+/*
+ * fanoutbench - cost of finding the subscribers an event goes to
+ *
+ * Subscribers on the control socket filter by source, button and edge.
+ * The daemon compiles the filters into one subscriber bitset per source,
+ * button and edge and ANDs three of them per event. This benchmark
+ * compares that with evaluating every subscriber's filter in turn, for
+ * 1,000 subscribers (or the number given) with the filter mix of a stage
+ * setup: most subscribers want one or two buttons of one source, a few
+ * want everything.
+ *
+ * Build and run:
+ *
+ *   gcc -O2 -Wall -o fanoutbench bench/fanoutbench.c
+ *   ./fanoutbench [SUBSCRIBERS [EVENTS]]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NSOURCES        3
+#define NBUTTONS        6
+#define MAX_SUBSCRIBERS 65536
+#define DEFAULT_EVENTS  (1 << 20)
+
+typedef struct filter
+{
+    uint32_t sources;
+    uint32_t buttons;
+    uint32_t edges;
+} filter_t;
+
+typedef struct event
+{
+    int source;
+    int button;
+    int edge;
+} event_t;
+
+uint64_t        now(void);
+uint64_t        nextRandom(void);
+uint64_t        fanoutPredicate(const filter_t *filters, int count,
+                                const event_t *events, size_t n);
+uint64_t        fanoutBitset(int words, const event_t *events, size_t n);
+void           *xcalloc(size_t count, size_t size);
+
+static uint64_t  randomState = 0x9e3779b97f4a7c15ULL;
+static uint64_t *sourceSets[NSOURCES];
+static uint64_t *buttonSets[NBUTTONS];
+static uint64_t *edgeSets[2];
+static uint64_t *liveSet;
+
+uint64_t
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t
+nextRandom(void)
+{
+    // xorshift64*
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return randomState * 0x2545f4914f6cdd1dULL;
+}
+
+void *
+xcalloc(size_t count, size_t size)
+{
+    void *p;
+
+    if ((p = calloc(count ? count : 1, size)) == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * Both functions return the sum of matched slot numbers, so their results
+ * can be compared, and the work cannot be optimized away.
+ */
+uint64_t
+fanoutPredicate(const filter_t *filters, int count, const event_t *events,
+                size_t n)
+{
+    uint64_t sum = 0;
+    size_t   i;
+    int      slot;
+
+    for (i = 0; i < n; i++)
+        for (slot = 0; slot < count; slot++)
+            if ((filters[slot].sources >> events[i].source & 1) &&
+                (filters[slot].buttons >> events[i].button & 1) &&
+                (filters[slot].edges >> events[i].edge & 1))
+                sum += slot;
+    return sum;
+}
+
+uint64_t
+fanoutBitset(int words, const event_t *events, size_t n)
+{
+    uint64_t sum = 0, bits;
+    size_t   i;
+    int      w;
+
+    for (i = 0; i < n; i++)
+        for (w = 0; w < words; w++)
+            for (bits = liveSet[w] & sourceSets[events[i].source][w] &
+                        buttonSets[events[i].button][w] &
+                        edgeSets[events[i].edge][w];
+                 bits; bits &= bits - 1)
+                sum += w * 64 + __builtin_ctzll(bits);
+    return sum;
+}
+
+int
+main(int argc, char **argv)
+{
+    filter_t *filters;
+    event_t  *events;
+    size_t    n = DEFAULT_EVENTS, i, matches;
+    uint64_t  start, predicateTime, bitsetTime, predicateSum, bitsetSum, r;
+    int       count = 1000, words, slot, k;
+
+    if (argc > 1)
+        count = atoi(argv[1]);
+    if (argc > 2)
+        n = strtoul(argv[2], NULL, 10);
+    if (count < 1 || count > MAX_SUBSCRIBERS || n == 0) {
+        fprintf(stderr, "usage: %s [SUBSCRIBERS [EVENTS]]\n", argv[0]);
+        exit(1);
+    }
+    words = (count + 63) / 64;
+
+    filters = xcalloc(count, sizeof(*filters));
+    for (k = 0; k < NSOURCES; k++)
+        sourceSets[k] = xcalloc(words, sizeof(uint64_t));
+    for (k = 0; k < NBUTTONS; k++)
+        buttonSets[k] = xcalloc(words, sizeof(uint64_t));
+    for (k = 0; k < 2; k++)
+        edgeSets[k] = xcalloc(words, sizeof(uint64_t));
+    liveSet = xcalloc(words, sizeof(uint64_t));
+
+    for (slot = 0; slot < count; slot++) {
+        r = nextRandom();
+        if (r % 20 == 0) {
+            filters[slot].sources = (1U << NSOURCES) - 1;
+            filters[slot].buttons = (1U << NBUTTONS) - 1;
+            filters[slot].edges = 3;
+        } else {
+            filters[slot].sources = 1U << ((r >> 8) % NSOURCES);
+            filters[slot].buttons = 1U << ((r >> 16) % NBUTTONS);
+            if (r & 1)
+                filters[slot].buttons |= 1U << ((r >> 24) % NBUTTONS);
+            filters[slot].edges = (r & 2) ? 2 : 3;
+        }
+        for (k = 0; k < NSOURCES; k++)
+            if (filters[slot].sources >> k & 1)
+                sourceSets[k][slot / 64] |= 1ULL << (slot % 64);
+        for (k = 0; k < NBUTTONS; k++)
+            if (filters[slot].buttons >> k & 1)
+                buttonSets[k][slot / 64] |= 1ULL << (slot % 64);
+        for (k = 0; k < 2; k++)
+            if (filters[slot].edges >> k & 1)
+                edgeSets[k][slot / 64] |= 1ULL << (slot % 64);
+        liveSet[slot / 64] |= 1ULL << (slot % 64);
+    }
+
+    // most events come from the receiver, as press/release pairs
+    events = xcalloc(n, sizeof(*events));
+    for (i = 0; i < n; i++) {
+        r = nextRandom();
+        events[i].source = (r % 10 < 8) ? 0 : 1 + (r >> 8) % (NSOURCES - 1);
+        events[i].button = (r >> 16) % NBUTTONS;
+        events[i].edge = i & 1;
+    }
+
+    start = now();
+    predicateSum = fanoutPredicate(filters, count, events, n);
+    predicateTime = now() - start;
+    start = now();
+    bitsetSum = fanoutBitset(words, events, n);
+    bitsetTime = now() - start;
+    if (predicateSum != bitsetSum)
+        fprintf(stderr, "result mismatch\n");
+
+    for (i = 0, matches = 0; i < n; i++)
+        for (slot = 0; slot < count; slot++)
+            if ((filters[slot].sources >> events[i].source & 1) &&
+                (filters[slot].buttons >> events[i].button & 1) &&
+                (filters[slot].edges >> events[i].edge & 1))
+                matches++;
+
+    printf("subscribers %d events %zu matches/event %.1f\n", count, n,
+           (double)matches / n);
+    printf("predicate %10.1f ns/event\n", (double)predicateTime / n);
+    printf("bitset    %10.1f ns/event\n", (double)bitsetTime / n);
+    return 0;
+}
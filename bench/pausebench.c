@@ -0,0 +1,213 @@
+/*
+ * pausebench - latency of the first event after an idle pause
+ *
+ * A presenter's click usually follows a pause, and finds the CPU idle in a
+ * deep power state. This benchmark measures how long an event takes to
+ * reach a thread blocked on a descriptor, as the daemon's run loop thread
+ * is, when the event follows PAUSE milliseconds of silence. It runs ROUNDS
+ * pauses twice: once with the receiving thread under the standard policy,
+ * and once under what -P switches on for a presentation session:
+ *
+ *   macOS  the time-constraint policy of the daemon and a power assertion
+ *          against idle sleep
+ *   Linux  SCHED_FIFO and a zero target written to /dev/cpu_dma_latency,
+ *          held open for the session (both need root)
+ *
+ * The daemon reports the same figure for real presses under "pause" in its
+ * stats; this benchmark gives the numbers without a remote in hand.
+ *
+ * Build and run:
+ *
+ *   gcc -O2 -Wall -o pausebench bench/pausebench.c -lpthread \
+ *       [-framework IOKit -framework CoreFoundation on macOS]
+ *   ./pausebench [ROUNDS [PAUSE]]
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#endif
+
+#define DEFAULT_ROUNDS 20
+#define DEFAULT_PAUSE  500              // milliseconds
+#define COMPUTATION    500000ULL        // as SESSION_COMPUTATION, nanoseconds
+#define CONSTRAINT     2000000ULL       // as SESSION_CONSTRAINT
+
+uint64_t        now(void);
+int             compareLatency(const void *a, const void *b);
+int             sessionBegin(void);
+void            sessionEnd(void);
+void           *receiverMain(void *arg);
+void            measure(const char *name, int session, int rounds, int pause);
+
+static int       fds[2];
+static int       session;
+static uint64_t *latency;
+static int       received;
+#ifdef __APPLE__
+static IOPMAssertionID assertion;
+#else
+static int       dmaLatency = -1;
+#endif
+
+uint64_t
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+compareLatency(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Called on the receiving thread. Returns 0 if the policy could not be
+ * changed; the run then measures the standard policy only.
+ */
+int
+sessionBegin(void)
+{
+#ifdef __APPLE__
+    thread_time_constraint_policy_data_t policy;
+    mach_timebase_info_data_t            timebase;
+
+    mach_timebase_info(&timebase);
+    policy.period = 0;
+    policy.computation = (uint32_t)(COMPUTATION * timebase.denom /
+                                    timebase.numer);
+    policy.constraint = (uint32_t)(CONSTRAINT * timebase.denom /
+                                   timebase.numer);
+    policy.preemptible = 1;
+    if (IOPMAssertionCreateWithName(kIOPMAssertPreventUserIdleSystemSleep,
+                                    kIOPMAssertionLevelOn,
+                                    CFSTR("pausebench session"),
+                                    &assertion) != kIOReturnSuccess)
+        assertion = 0;
+    return thread_policy_set(mach_thread_self(),
+                             THREAD_TIME_CONSTRAINT_POLICY,
+                             (thread_policy_t)&policy,
+                             THREAD_TIME_CONSTRAINT_POLICY_COUNT) ==
+           KERN_SUCCESS;
+#else
+    struct sched_param param = { .sched_priority = 50 };
+    int32_t            target = 0;
+
+    // the target holds only while the descriptor stays open
+    if ((dmaLatency = open("/dev/cpu_dma_latency", O_WRONLY)) >= 0 &&
+        write(dmaLatency, &target, sizeof(target)) != sizeof(target)) {
+        close(dmaLatency);
+        dmaLatency = -1;
+    }
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+#endif
+}
+
+void
+sessionEnd(void)
+{
+#ifdef __APPLE__
+    if (assertion)
+        IOPMAssertionRelease(assertion);
+    assertion = 0;
+#else
+    if (dmaLatency >= 0)
+        close(dmaLatency);
+    dmaLatency = -1;
+#endif
+}
+
+void *
+receiverMain(void *arg)
+{
+    uint64_t sent;
+    int      rounds = *(int *)arg;
+
+    if (session && !sessionBegin()) {
+        fprintf(stderr, "Cannot raise the receiving thread; run as root?\n");
+        session = -1;
+    }
+    for (received = 0; received < rounds; received++) {
+        if (read(fds[0], &sent, sizeof(sent)) != sizeof(sent))
+            break;
+        latency[received] = now() - sent;
+    }
+    if (session > 0)
+        sessionEnd();
+    return NULL;
+}
+
+void
+measure(const char *name, int withSession, int rounds, int pause)
+{
+    struct timespec gap = { pause / 1000, (pause % 1000) * 1000000L };
+    pthread_t       receiver;
+    uint64_t        sent;
+    int             i;
+
+    session = withSession;
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pthread_create(&receiver, NULL, receiverMain, &rounds);
+    for (i = 0; i < rounds; i++) {
+        nanosleep(&gap, NULL);
+        sent = now();
+        if (write(fds[1], &sent, sizeof(sent)) != sizeof(sent)) {
+            perror("write");
+            exit(1);
+        }
+    }
+    pthread_join(receiver, NULL);
+    close(fds[0]);
+    close(fds[1]);
+
+    if (session < 0 || received == 0)
+        return;
+    qsort(latency, received, sizeof(*latency), compareLatency);
+    printf("%-8s %d pauses of %d ms: p50 %6.1f p90 %6.1f max %6.1f us\n",
+           name, received, pause, latency[(received - 1) / 2] / 1e3,
+           latency[(received - 1) * 9 / 10] / 1e3,
+           latency[received - 1] / 1e3);
+}
+
+int
+main(int argc, char **argv)
+{
+    int rounds = DEFAULT_ROUNDS, pause = DEFAULT_PAUSE;
+
+    if (argc > 1)
+        rounds = atoi(argv[1]);
+    if (argc > 2)
+        pause = atoi(argv[2]);
+    if (rounds < 1 || pause < 0) {
+        fprintf(stderr, "usage: %s [ROUNDS [PAUSE]]\n", argv[0]);
+        exit(1);
+    }
+    if ((latency = calloc(rounds, sizeof(*latency))) == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    measure("idle", 0, rounds, pause);
+    measure("session", 1, rounds, pause);
+    return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * wsbench - WebSocket connection and press rates of a running daemon
+ *
+ * Drives the -W endpoint over the loopback interface. The first phase
+ * opens and upgrades CLIENTS connections and keeps them all open, and
+ * reports connections per second and the handshake latency. The second
+ * phase sends MESSAGES text frames spread over all of them, then pings
+ * every connection; the daemon handles a connection's frames in order, so
+ * once all pongs are back every message has been dispatched. The default
+ * message, "right", is a click: it goes through parsing, the client's rate
+ * limit, dispatch, the keymap and the sink queue like a phone's press.
+ *
+ * Bind right to F20 (key code 90), which no Mac keyboard has, so the
+ * presses post harmless keys, and raise the per-client limit if the
+ * figure should not include limited presses:
+ *
+ *   printf 'right arrows 90\n' > /tmp/f20.keymap
+ *   ./iremoted -m /tmp/f20.keymap -W 8765 -r websocket:100000/100000 -s 10
+ *
+ * Build and run:
+ *
+ *   gcc -O2 -Wall -o wsbench bench/wsbench.c
+ *   ./wsbench 8765 [CLIENTS [MESSAGES [MESSAGE]]]
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BURST           32              // frames per write
+#define MAX_MESSAGE     125
+#define DEFAULT_CLIENTS 1000
+#define DEFAULT_MSGS    100000
+#define DEFAULT_MESSAGE "right"
+
+uint64_t        now(void);
+void            fail(const char *what);
+int             wsConnect(int port);
+void            wsClose(int fd);
+size_t          wsFrame(unsigned char *out, int opcode, const char *payload,
+                        size_t length);
+void            wsAwaitPong(int fd);
+int             compareLatency(const void *a, const void *b);
+
+uint64_t
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+fail(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+int
+compareLatency(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Connect to 127.0.0.1:port and complete the upgrade. The key is fixed;
+ * the daemon does not care, and the reply is only checked for 101.
+ */
+int
+wsConnect(int port)
+{
+    static const char request[] =
+        "GET / HTTP/1.1\r\n"
+        "Host: 127.0.0.1\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n\r\n";
+    struct sockaddr_in addr;
+    char               reply[512];
+    size_t             length = 0;
+    ssize_t            n;
+    int                fd, on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        fail("socket");
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        fail("connect");
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (write(fd, request, sizeof(request) - 1) != sizeof(request) - 1)
+        fail("write");
+
+    // the daemon sends nothing after the reply until it is pinged
+    while (length < sizeof(reply) - 1) {
+        if ((n = read(fd, reply + length, sizeof(reply) - 1 - length)) <= 0)
+            fail("handshake");
+        length += n;
+        reply[length] = '\0';
+        if (strstr(reply, "\r\n\r\n"))
+            break;
+    }
+    if (strncmp(reply, "HTTP/1.1 101", 12) != 0) {
+        fprintf(stderr, "handshake rejected\n");
+        exit(1);
+    }
+    return fd;
+}
+
+/*
+ * Client frames must be masked; an all-zero mask leaves the payload as is.
+ */
+size_t
+wsFrame(unsigned char *out, int opcode, const char *payload, size_t length)
+{
+    out[0] = 0x80 | opcode;
+    out[1] = 0x80 | length;
+    memset(out + 2, 0, 4);
+    memcpy(out + 6, payload, length);
+    return 6 + length;
+}
+
+void
+wsAwaitPong(int fd)
+{
+    unsigned char frame[2 + MAX_MESSAGE];
+    size_t        length = 0;
+    ssize_t       n;
+
+    while (length < 2 || length < 2 + (size_t)(frame[1] & 0x7f)) {
+        if ((n = read(fd, frame + length, sizeof(frame) - length)) <= 0)
+            fail("pong");
+        length += n;
+    }
+    if (frame[0] != 0x8a) {
+        fprintf(stderr, "unexpected frame 0x%02x\n", frame[0]);
+        exit(1);
+    }
+}
+
+void
+wsClose(int fd)
+{
+    unsigned char frame[6];
+
+    (void)write(fd, frame, wsFrame(frame, 0x8, "", 0));
+    close(fd);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned char  burst[BURST * (6 + MAX_MESSAGE)], ping[6];
+    const char    *message = DEFAULT_MESSAGE;
+    struct rlimit  files;
+    uint64_t      *latency, start, t, elapsed;
+    size_t         frameLength, sent, total, n, i;
+    int           *fds;
+    int            port, clients = DEFAULT_CLIENTS, k;
+
+    if (argc > 2)
+        clients = atoi(argv[2]);
+    total = (argc > 3) ? strtoul(argv[3], NULL, 10) : DEFAULT_MSGS;
+    if (argc > 4)
+        message = argv[4];
+    if (argc < 2 || (port = atoi(argv[1])) <= 0 || port > 65535 ||
+        clients < 1 || total == 0 || strlen(message) > MAX_MESSAGE) {
+        fprintf(stderr, "usage: %s PORT [CLIENTS [MESSAGES [MESSAGE]]]\n",
+                argv[0]);
+        exit(1);
+    }
+
+    // every client is a descriptor; macOS starts processes with 256
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 &&
+        files.rlim_cur < (rlim_t)clients + 16) {
+        files.rlim_cur = (rlim_t)clients + 16;
+        if (setrlimit(RLIMIT_NOFILE, &files) < 0)
+            fail("setrlimit");
+    }
+    latency = calloc(clients, sizeof(*latency));
+    fds = calloc(clients, sizeof(*fds));
+    if (latency == NULL || fds == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    start = now();
+    for (k = 0; k < clients; k++) {
+        t = now();
+        fds[k] = wsConnect(port);
+        latency[k] = now() - t;
+    }
+    elapsed = now() - start;
+    qsort(latency, clients, sizeof(*latency), compareLatency);
+    printf("connections %d open in %.1f ms: %.0f/s, handshake p50 %.1f us "
+           "p99 %.1f us\n", clients, elapsed / 1e6, clients * 1e9 / elapsed,
+           latency[(clients - 1) / 2] / 1e3,
+           latency[(clients - 1) * 99 / 100] / 1e3);
+
+    frameLength = wsFrame(burst, 0x1, message, strlen(message));
+    for (i = 1; i < BURST; i++)
+        memcpy(burst + i * frameLength, burst, frameLength);
+    wsFrame(ping, 0x9, "", 0);
+
+    start = now();
+    for (sent = 0, k = 0; sent < total; sent += n, k = (k + 1) % clients) {
+        n = (total - sent < BURST) ? total - sent : BURST;
+        if (write(fds[k], burst, n * frameLength) != (ssize_t)(n * frameLength))
+            fail("write");
+    }
+    for (k = 0; k < clients; k++)
+        if (write(fds[k], ping, sizeof(ping)) != sizeof(ping))
+            fail("write");
+    for (k = 0; k < clients; k++)
+        wsAwaitPong(fds[k]);
+    elapsed = now() - start;
+    for (k = 0; k < clients; k++)
+        wsClose(fds[k]);
+
+    printf("messages %zu over %d clients in %.1f ms: %.0f/s\n", total,
+           clients, elapsed / 1e6, total * 1e9 / elapsed);
+    free(fds);
+    free(latency);
+    return 0;
+}
@@ -37,18 +37,40 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sys/errno.h>
 #include <sysexits.h>
 #include <mach/mach.h>
 #include <mach/mach_error.h>
+#include <mach/mach_time.h>
 #include <IOKit/IOKitLib.h>
 #include <IOKit/IOCFPlugIn.h>
 #include <IOKit/hid/IOHIDLib.h>
 #include <IOKit/hid/IOHIDKeys.h>
 #include <IOKit/hid/IOHIDUsageTables.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <IOKit/IOMessage.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <Carbon/Carbon.h>
+#include <objc/runtime.h>
+#include <objc/message.h>
+
+// AppKit, declared here since its headers are Objective-C only
+extern CFStringRef NSWorkspaceDidActivateApplicationNotification;
+extern CFStringRef NSWorkspaceApplicationKey;
 
 
 static struct option
@@ -56,11 +78,32 @@ long_options[] = {
     { "help",    no_argument, 0, 'h' },
     { "keynote", no_argument, 0, 'k' },
     { "arrows", no_argument, 0, 'a' },
+    { "stats",   required_argument, 0, 's' },
+    { "workers", required_argument, 0, 'w' },
+    { "journal", required_argument, 0, 'j' },
+    { "rate-limit",  required_argument, 0, 'r' },
+    { "rate-policy", required_argument, 0, 'p' },
+    { "deadline",    required_argument, 0, 'd' },
+    { "keymap",        required_argument, 0, 'm' },
+    { "shadow-keymap", required_argument, 0, 'M' },
+    { "inject",  required_argument, 0, 'i' },
+    { "control", required_argument, 0, 'c' },
+    { "websocket", required_argument, 0, 'W' },
+    { "origin",    required_argument, 0, 'O' },
+    { "lircd",     required_argument, 0, 'l' },
+    { "lircd-input", required_argument, 0, 'L' },
+    { "cues",    required_argument, 0, 'q' },
+    { "bench",   required_argument, 0, 'b' },
+    { "tune",    required_argument, 0, 'T' },
+    { "presentation", required_argument, 0, 'P' },
+    { "hold",    no_argument, 0, 'H' },
     { 0, 0, 0, 0 },
 };
 
-static const char *options = "hka";
+static const char *options = "hkaHs:w:j:r:p:d:m:M:i:c:W:O:l:L:q:b:T:P:";
 
+IOHIDElementCookie buttonMenuID = 0;
+IOHIDElementCookie buttonSelectID = 0;
 IOHIDElementCookie buttonNextID = 0;
 IOHIDElementCookie buttonPreviousID = 0;
 IOHIDElementCookie buttonUpID = 0;
@@ -83,194 +126,4560 @@ enum {
 };
 
 static const char *keynoteID = "com.apple.iWork.Keynote";
+
+#define KEYNOTE_EVENTS 2
+
+static const AEEventID keynoteEventIDs[KEYNOTE_EVENTS] = {
+    slideForward, slideBackward
+};
+
+static AppleEvent keynoteEvents[KEYNOTE_EVENTS] = {
+    { typeNull, nil }, { typeNull, nil }
+};
 static int driveKeynote = 0;
 static int driveKeyboardArrows = 0;
+static int statsInterval = 0;
+static int workerCount = 0;
+static FILE *journal = NULL;
+
+enum {
+    BUTTON_MENU = 0,
+    BUTTON_SELECT,
+    BUTTON_NEXT,
+    BUTTON_PREVIOUS,
+    BUTTON_UP,
+    BUTTON_DOWN,
+    NBUTTONS,
+    BUTTON_NONE = -1
+};
+
+static const char *buttonNames[NBUTTONS] = {
+    "menu", "select", "right", "left", "up", "down"
+};
+
+/*
+ * Input sources. Events from every source go through dispatchEvent(), so
+ * they are logged, limited and mapped the same way.
+ */
+enum {
+    SOURCE_IR = 0,
+    SOURCE_WEBSOCKET,
+    SOURCE_LIRC,
+    NSOURCES
+};
+
+static const char *sourceNames[NSOURCES] = {
+    "ir", "websocket", "lircd"
+};
+
+/*
+ * Rate limits are token buckets implemented as GCRA: a bucket only stores
+ * its theoretical arrival time, so a check is a load, a compare and at most
+ * one compare-and-swap, with no lock on the event path. Buckets exist per
+ * button (the daemon drives a single receiver, so the button identifies the
+ * device input) and per sink. Excess presses are dropped, coalesced into a
+ * single delayed press, or delayed until a token is available.
+ */
+enum {
+    RATE_DROP = 0,
+    RATE_COALESCE,
+    RATE_DELAY
+};
+
+typedef struct rate_limit
+{
+    UInt64                interval;   // nanoseconds per token, 0 = unlimited
+    UInt64                tolerance;  // (burst - 1) * interval
+    _Atomic UInt64        tat;        // theoretical arrival time
+    _Atomic UInt64        pending;    // coalesced press due at this time
+    _Atomic unsigned long limited;
+} rate_limit_t;
+
+/*
+ * Element cookies are small integers handed out by the HID driver. Once
+ * the element dictionaries have been parsed at attach time, the cookie to
+ * button mapping is compiled into a table indexed by cookie, so decoding an
+ * event is a single load. The table also keeps the last value of every
+ * element. Once an element has reported a release (value 0), a report that
+ * repeats its last value carries no information and is skipped before any
+ * further work. An element that has never reported a release may report
+ * presses only, and each of those is a real press, so its reports are
+ * never skipped.
+ */
+#define COOKIE_TABLE_SIZE 256
+
+typedef struct cookie_slot
+{
+    signed char button;
+    bool        releases;       // has reported value 0
+    SInt32      value;
+} cookie_slot_t;
+
+static cookie_slot_t cookieTable[COOKIE_TABLE_SIZE];
+static unsigned long unchangedReports = 0;
+
+static int          ratePolicy = RATE_DROP;
+static rate_limit_t buttonLimits[NBUTTONS];
+
+/*
+ * Every ingested event gets a monotonically increasing trace ID. It is
+ * carried by all sink tasks the event produces and shows up in the event
+ * log, in error messages and in the journal, so a failure can be tied back
+ * to the press that caused it. Only the run loop thread assigns IDs.
+ */
+static UInt64 lastTraceID = 0;
+
+/*
+ * Errors are aggregated by code. Each code is reported at most once per
+ * ERROR_REPORT_INTERVAL; repeats in between are only counted, so an error
+ * storm cannot flood stderr and stall the workers.
+ */
+#define ERROR_CODES           16
+#define ERROR_REPORT_INTERVAL 1000000000ULL // nanoseconds
+
+typedef struct error_record
+{
+    int           code;
+    unsigned long count;
+    unsigned long suppressed;
+    UInt64        lastReport;
+} error_record_t;
+
+static error_record_t  errorRecords[ERROR_CODES];
+static int             errorRecordCount = 0;
+static unsigned long   errorOverflow = 0;
+static pthread_mutex_t errorLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Sinks execute the actions triggered by button presses. Their costs differ
+ * wildly (a CGEventPost takes microseconds, an Apple event sent to Keynote
+ * may block for seconds), so they never run on the run loop thread. Every
+ * sink owns a serial task queue. A non-empty queue is scheduled on the
+ * worker pool as a unit: idle workers steal whole queues from busy ones,
+ * which keeps the tasks of one sink in order while different sinks proceed
+ * in parallel.
+ *
+ * A task may carry a deadline, derived from the press timestamp and the
+ * budget of its sink. Workers always pick the ready queue whose next task
+ * is due first, and tasks that can no longer meet their deadline are
+ * dropped and counted as misses: a slide change long after the press only
+ * confuses the presenter.
+ *
+ * Sinks past NMAPPEDSINKS are internal and cannot be bound in a keymap.
+ */
+enum {
+    SINK_ARROWS = 0,
+    SINK_KEYNOTE,
+    NMAPPEDSINKS,
+    SINK_SHADOW = NMAPPEDSINKS,
+    NSINKS
+};
+
+#define SINK_QUEUE_DEPTH 64
+#define SINK_BATCH       8
+#define MAX_WORKERS      16
+
+typedef struct sink_task
+{
+    UInt64 trace;
+    UInt64 notBefore;           // delayed by a rate limit, 0 = run now
+                                // (queued only once due)
+    UInt64 deadline;            // 0 = none
+    UInt32 action;              // CGKeyCode, AEEventID or button, by sink
+} sink_task_t;
+
+typedef struct sink_queue
+{
+    const char     *name;
+    OSStatus      (*execute)(sink_task_t *task);
+    pthread_mutex_t lock;
+    sink_task_t     tasks[SINK_QUEUE_DEPTH];
+    unsigned int    head;
+    unsigned int    count;
+    int             scheduled;  // sitting in a worker deque or running
+    unsigned long   executed;
+    unsigned long   failed;
+    unsigned long   dropped;
+    unsigned long   missed;
+    unsigned int    maxDepth;
+    rate_limit_t    limit;
+    UInt64          budget;     // nanoseconds from press to deadline
+} *sink_queue_t;
+
+typedef struct worker
+{
+    pthread_t             thread;
+    pthread_mutex_t       lock;
+    sink_queue_t          deque[NSINKS]; // owner pops the newest, thieves
+                                         // the oldest
+    int                   count;
+    _Atomic unsigned long executed;      // read by the stats without lock
+    _Atomic unsigned long steals;
+} *worker_t;
+
+static const char *sinkNames[NSINKS] = {
+    "arrows", "keynote", "shadow"
+};
+
+/*
+ * A keymap binds every button to at most one action per sink. The live
+ * keymap is built from -a and -k or loaded with -m. A candidate keymap
+ * loaded with -M is evaluated in shadow mode: each press is re-run against
+ * it on the shadow sink, off the dispatch path, and every difference from
+ * the live keymap is recorded instead of executed.
+ */
+typedef struct keymap_entry
+{
+    UInt32 action;              // 0 = unmapped
+    UInt64 budget;              // deadline override, 0 = sink default
+} keymap_entry_t;
+
+typedef struct keymap
+{
+    keymap_entry_t map[NBUTTONS][NMAPPEDSINKS];
+} *keymap_t;
+
+enum {
+    DIVERGE_ACTION = 0,         // both map the sink, to different actions
+    DIVERGE_SINK,               // only one of them maps the sink
+    DIVERGE_TIMING,             // same action, different deadline
+    NDIVERGENCES
+};
+
+#define DIVERGENCE_RING 64
+
+typedef struct divergence
+{
+    UInt64 trace;
+    int    button;
+    int    sink;
+    int    kind;
+    UInt32 live;
+    UInt32 shadow;
+} divergence_t;
+
+static const char *divergenceNames[NDIVERGENCES] = {
+    "action", "sink", "timing"
+};
+
+/*
+ * With a cue list (-q) the next button is GO and the previous button is
+ * BACK, as on a show control desk. GO fires the cue on standby and puts the
+ * following cue on standby; BACK moves standby one cue back without firing
+ * anything. A cue is a set of sink actions, each with an offset from GO.
+ * The list is compiled when it is loaded: actions are encoded and ordered
+ * by offset, and their keyboard events are created with the rest of the
+ * keyboard cache, so firing a cue is one pass over ready tasks.
+ */
+#define MAX_CUES        256
+#define MAX_CUE_ACTIONS 16
+#define CUE_NAME        32
+
+typedef struct cue_action
+{
+    int    sink;
+    UInt32 action;
+    UInt64 offset;              // nanoseconds after GO
+} cue_action_t;
+
+typedef struct cue
+{
+    char         name[CUE_NAME];
+    int          count;
+    cue_action_t actions[MAX_CUE_ACTIONS];
+} cue_t;
+
+static cue_t         cues[MAX_CUES];
+static int           cueCount = 0;
+static int           cueStandby = 0;
+static unsigned long cuesFired = 0;
+static UInt64        cueLatencyLast = 0;
+static UInt64        cueLatencyMax = 0;
+static UInt64        cueLatencyTotal = 0;
+
+/*
+ * Keyboard events are posted through a single event source created at
+ * startup, and the key down/up pair of every key code bound in the live
+ * keymap is created ahead of time, so a press only has to stamp and post
+ * two ready events. Only the serial arrows sink touches the cache after
+ * startup.
+ */
+#define KEYCODES 128
+
+static CGEventSourceRef keyboardSource = NULL;
+static CGEventRef       keyDownEvents[KEYCODES];
+static CGEventRef       keyUpEvents[KEYCODES];
+
+/*
+ * With -H the arrows sink passes holds through: a key goes down when its
+ * button is pressed and up when the button is released, instead of both at
+ * the press, so applications see the key held for as long as the button.
+ * The dispatcher remembers the key each button holds, so the release goes
+ * to the key that went down even if the keymap changed in between. The
+ * arrows sink counts the keys that are actually down, so a release whose
+ * press was dropped (rate limit, deadline, full queue) posts nothing, and a
+ * key held through two buttons goes up with the last of them.
+ *
+ * A release is never dropped. It runs no earlier than its press, which may
+ * have been delayed, and half of the pending set is kept free for such
+ * releases. A release that finds the arrows queue full is counted per key
+ * code instead and moved into the queue as soon as a slot frees up, ahead
+ * of anything published later.
+ */
+#define KEY_DOWN_ONLY 0x100             // ORed into arrows actions
+#define KEY_UP_ONLY   0x200
+#define KEY_UP_WAIT   100000000ULL      // nanoseconds to wait for releases
+
+static int           holdPassthrough = 0;
+static CGKeyCode     heldKeys[NBUTTONS];     // run loop thread only
+static UInt64        heldNotBefore[NBUTTONS];
+static int           keysDown[KEYCODES];     // arrows sink only
+static _Atomic int   keysDownTotal = 0;
+static unsigned int  lateReleases[KEYCODES]; // under the arrows queue lock
+static UInt64        lateTraces[KEYCODES];
+static unsigned int  lateReleaseCount = 0;
+static unsigned long lateReleaseTotal = 0;
+static unsigned long stuckKeys = 0;
+
+/*
+ * Keystrokes can be injected at three points of the event system. Which one
+ * is fastest, and which one works at all, depends on the host, so with
+ * "-i auto" the daemon posts a marked probe key at each of them and picks
+ * the one whose events show up soonest at a listen-only event tap. The
+ * probe can be repeated over the control socket. Once the daemon runs, the
+ * probe takes seconds, so it gets a thread and run loop of its own and the
+ * input keeps being serviced meanwhile.
+ */
+enum {
+    INJECT_HID = 0,
+    INJECT_SESSION,
+    INJECT_ANNOTATED,
+    NINJECTS
+};
+
+#define PROBE_KEYCODE 0x5A              // F20, absent from Apple keyboards
+#define PROBE_MARK    0x69726d74        // 'irmt' in kCGEventSourceUserData
+#define PROBE_ROUNDS  16
+#define PROBE_TIMEOUT 50000000ULL       // nanoseconds per round
+
+static const char *injectNames[NINJECTS] = {
+    "hid", "session", "annotated"
+};
+
+static const CGEventTapLocation injectLocations[NINJECTS] = {
+    kCGHIDEventTap, kCGSessionEventTap, kCGAnnotatedSessionEventTap
+};
+
+static _Atomic int injectPoint = INJECT_ANNOTATED;
+static int         injectAuto = 0;
+static _Atomic UInt64 probeLatency[NINJECTS]; // median ns, 0 = unseen
+static _Atomic int probeRunning = 0;
+static UInt64      probeObserved = 0;      // thread of the probe only
+static UInt64      probePosted = 0;        // timestamp of the observed event
+
+/*
+ * The closed-loop benchmark (-b) feeds presses through the lircd input
+ * (-L), acting as lircd on a loopback Unix socket. Each press is read on
+ * the run loop, goes through the rate limit, the keymap and
+ * dispatchEvent() like any other, is queued on the arrows sink, picked up
+ * by a worker, posted from the key event cache and observed at an event
+ * tap. BENCH_BUTTON is bound to the marked probe key for the benchmark.
+ * It reports the latency distribution from writing the press to posting,
+ * from posting to the tap, and overall, optionally while LOAD threads keep
+ * every core busy.
+ */
+#define BENCH_GAP    0.002              // seconds between rounds
+#define BENCH_BUTTON BUTTON_MENU
+
+static int         benchRounds = 0;
+static int         benchLoad = 0;
+static _Atomic int benchLoading = 0;
+
+/*
+ * The what-if tuner (-T) replays the presses recorded in journals through
+ * the button rate limit and the live keymap under a grid of rate limit
+ * settings, on a simulated clock taken from the journal timestamps. Every
+ * journal counts as a room and every source in it as a device. Parameter
+ * sets are spread over one thread per core; each keeps its own limiter
+ * state, so they share nothing but the read-only events.
+ *
+ * A press that follows the previous press of the same button by at least
+ * TUNE_DELIBERATE is taken as deliberate, anything faster as a repeat or
+ * bounce. The suggested setting is the one that suppresses the most
+ * repeats while losing at most 1% of deliberate presses and missing at
+ * most 1% of deadlines.
+ */
+#define MAX_ROOMS       16
+#define TUNE_DELIBERATE 150000000ULL    // nanoseconds
+
+typedef struct tune_event
+{
+    UInt64 time;
+    int    group;                       // room * NSOURCES + source
+    int    button;
+    int    deliberate;
+} tune_event_t;
+
+typedef struct tune_set
+{
+    double rate;                        // presses per second, 0 = no limit
+    int    burst;
+    int    policy;
+} tune_set_t;
+
+typedef struct tune_result
+{
+    unsigned long presses;
+    unsigned long deliberate;
+    unsigned long actions;
+    unsigned long suppressed;
+    unsigned long lostDeliberate;
+    unsigned long delayed;
+    unsigned long misses;
+    UInt64        delayTotal;
+    UInt64        delayMax;
+} tune_result_t;
+
+static const double tuneRates[] = { 2, 4, 8, 16 };
+static const int    tuneBursts[] = { 1, 3 };
+static const char  *policyNames[] = { "drop", "coalesce", "delay" };
+
+static const char    *roomPaths[MAX_ROOMS];
+static int            roomCount = 0;
+static tune_event_t  *tuneEvents = NULL;
+static size_t         tuneEventCount = 0;
+static tune_set_t    *tuneSets = NULL;
+static int            tuneSetCount = 0;
+static tune_result_t *tuneResults = NULL; // [set][group]
+static _Atomic int    tuneNextSet = 0;
+
+/*
+ * The last HISTORY_SIZE events are kept in a ring, numbered by sequence.
+ * Subscribers on the control socket only hold a cursor into the ring and
+ * are fed from it directly, so a subscriber that reconnects after a blip
+ * can resume from the last sequence it saw. Events that have already been
+ * overwritten are reported as a gap instead.
+ */
+#define HISTORY_SIZE 1024
+
+typedef struct history_event
+{
+    UInt64 trace;
+    UInt64 timestamp;
+    int    source;
+    int    button;
+    SInt32 value;
+} history_event_t;
+
+static history_event_t history[HISTORY_SIZE];
+static UInt64          historyNext = 1;  // sequence of the next event
+static unsigned long   historyGaps = 0;
+
+/*
+ * The control socket accepts one command per line: "stats" prints the
+ * statistics, "probe" re-runs the injection probe, and "subscribe" turns
+ * the connection into an event stream:
+ *
+ *   subscribe [from N] [source=LIST] [button=LIST] [edge=pressed|depressed]
+ *
+ * optionally replaying the history from sequence N and only passing events
+ * that match the filters. A subscribed connection takes no more commands.
+ *
+ * Filters are compiled into subscriber bitsets, one per source, button and
+ * edge, with a bit per subscriber slot. The subscribers an event goes to
+ * are the AND of its three sets with the set of live subscribers, so the
+ * fan-out cost follows the number of matches, not of subscribers, and each
+ * event is formatted once. A subscriber whose socket backs up leaves the
+ * live set and catches up from the history ring on its own cursor.
+ */
+#define CONTROL_LINE     256
+#define CONTROL_OUT      2048
+#define EVENT_LINE       128
+#define MAX_SUBSCRIBERS  1024
+#define SUBSCRIBER_WORDS (MAX_SUBSCRIBERS / 64)
+
+typedef UInt64 subscriber_set_t[SUBSCRIBER_WORDS];
+
+typedef struct control_client
+{
+    CFSocketRef        socket;
+    CFRunLoopSourceRef source;
+    size_t             length;
+    char               line[CONTROL_LINE];
+    int                subscribed;
+    int                slot;
+    UInt64             cursor;          // next sequence, while lagging
+    UInt32             sources;         // filter masks, for the catch-up
+    UInt32             buttons;         // bit 0 = no button
+    UInt32             edges;           // bit 0 = depressed, bit 1 = pressed
+    size_t             pending;
+    char               out[CONTROL_OUT];
+} *control_client_t;
+
+static const char      *controlPath = NULL;
+static control_client_t subscriberSlots[MAX_SUBSCRIBERS];
+static subscriber_set_t sourceSubscribers[NSOURCES];
+static subscriber_set_t buttonSubscribers[NBUTTONS + 1];
+static subscriber_set_t edgeSubscribers[2];
+static subscriber_set_t liveSubscribers;
+static subscriber_set_t laggingSubscribers;
+static UInt64           publishedNext = 1;  // first event not fanned out
+static unsigned long    subscriberCount = 0;
+static unsigned long    fanoutLines = 0;
+
+/*
+ * The receiver handle goes stale across sleep, so it is released when the
+ * system is about to sleep and reattached as soon as it wakes, reusing the
+ * element map parsed at startup. Until the receiver answers again the
+ * reattach is retried every REATTACH_RETRY seconds. With -L lircd owns the
+ * receiver, so it is not opened at all; with -W it is optional, and a Mac
+ * without one is driven by the WebSocket clients alone. In both cases there
+ * is nothing to reattach after wake.
+ */
+#define REATTACH_RETRY 0.1
+
+static IOHIDDeviceInterface **hidDeviceInterface = NULL;
+static IOHIDQueueInterface  **hidQueue = NULL;
+static CFRunLoopSourceRef     hidQueueSource = NULL;
+static cookie_struct_t        hidCookies = NULL;
+static bool                   hidDeviceOpen = false;
+static bool                   receiverUsed = true;
+static CFRunLoopTimerRef      statsTimer = NULL;
+static io_connect_t           powerPort = MACH_PORT_NULL;
+static IONotificationPortRef  powerNotifyPort = NULL;
+static io_object_t            powerNotifier;
+static CFRunLoopTimerRef      reattachTimer = NULL;
+static UInt64                 wakeTime = 0;
+static UInt64                 lastResumeReady = 0;
+static unsigned long          sleepCount = 0;
+static unsigned long          reattachFailures = 0;
+
+/*
+ * The first press after a pause is the one a presenter notices, and the
+ * one that finds the machine idle. With -P SECONDS, a press that triggers
+ * an action starts a presentation session, which ends once no press has
+ * arrived for SECONDS. While a session is active the run loop thread, which
+ * receives the presses, runs under a time-constraint policy, so it is woken
+ * and scheduled ahead of ordinary threads, and a power assertion keeps the
+ * system from idling into sleep. The stats compare how long presses that
+ * follow a pause of PAUSE_GAP or more take from the receiver to dispatch,
+ * inside and outside a session. bench/pausebench.c measures the same
+ * without a remote.
+ */
+#define PAUSE_GAP          2000000000ULL  // nanoseconds
+#define SESSION_COMPUTATION 500000ULL     // nanoseconds per wakeup
+#define SESSION_CONSTRAINT 2000000ULL
+
+static double            sessionTimeout = 0;
+static CFRunLoopTimerRef sessionTimer = NULL;
+static mach_port_t       runLoopThread = MACH_PORT_NULL;
+static int               sessionActive = 0;
+static IOPMAssertionID   sessionAssertion = 0;
+static unsigned long     sessionCount = 0;
+static UInt64            lastPressTime = 0;
+static unsigned long     pauseCount[2];     // [1] = inside a session
+static UInt64            pauseLatencyTotal[2];
+static UInt64            pauseLatencyMax[2];
+
+/*
+ * Event timestamps are kept in one clock domain: nanoseconds of
+ * mach_absolute_time(), which IOKit already uses for HID events (it is the
+ * macOS monotonic clock, stopping during sleep like CLOCK_UPTIME_RAW). lircd
+ * reports no timestamps, so its events are stamped on arrival. WebSocket
+ * clients may send their own "t=MILLISECONDS"; since every client has its
+ * own clock, each one gets a clock_domain that estimates offset and drift.
+ * The filter takes the minimum of arrival minus remote time over every
+ * CLOCK_WINDOW samples (the sample with the least transit delay), fits the
+ * drift between consecutive minima, and tracks how far each new minimum
+ * lands from the prediction as the clock error.
+ */
+#define CLOCK_WINDOW 32
+
+typedef struct clock_domain
+{
+    int    windowCount;
+    double windowMin;           // smallest arrival - remote in this window
+    double windowRemote;        // remote time of that sample
+    int    anchored;
+    double anchorOffset;        // offset fitted at anchorRemote
+    double anchorRemote;
+    double drift;               // change of offset per remote nanosecond
+    double error;               // smoothed prediction error, nanoseconds
+} clock_domain_t;
+
+/*
+ * Phones and browsers can act as remotes through a WebSocket endpoint on
+ * the loopback interface. Clients are plain run loop sockets, with no
+ * thread per connection. Every text message names a button, optionally
+ * followed by "pressed" or "depressed"; a bare button name is a full click.
+ * A "t=MILLISECONDS" token carries the client's own timestamp for the press.
+ * Each client has its own rate limit, set with -r websocket:RATE[/BURST].
+ * The handshake needs SHA-1, which is computed locally: CommonCrypto's
+ * CC_SHA1 is deprecated, and the digest is not used for security here.
+ *
+ * Any web page in the presenter's browser can open a WebSocket to the
+ * loopback interface, so the upgrade request must be a well-formed
+ * version 13 GET, and a request carrying an Origin header (which browsers
+ * always send) is refused unless the origin was allowed with -O. Clients
+ * other than browsers send no Origin and are accepted.
+ *
+ * Fragmented text messages are reassembled up to WEBSOCKET_MESSAGE bytes,
+ * which is far more than any button message needs; a longer one closes
+ * the connection with 1009, and a broken fragment sequence with 1002.
+ */
+#define WEBSOCKET_BUFFER 4096
+#define WEBSOCKET_RATE   20
+#define WEBSOCKET_BURST  10
+#define WEBSOCKET_GUID   "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define SHA1_LENGTH      20
+#define MAX_ORIGINS      8
+#define WEBSOCKET_MESSAGE 125
+#define WEBSOCKET_CLIENTS 4096          // open at once
+
+typedef struct websocket_client
+{
+    CFSocketRef        socket;
+    CFRunLoopSourceRef source;
+    int                open;            // handshake completed
+    size_t             length;
+    unsigned char      buffer[WEBSOCKET_BUFFER + 1];
+    rate_limit_t       limit;
+    clock_domain_t     clock;
+    UInt32             held;            // buttons pressed, not yet released
+    int                fragments;       // opcode of the unfinished message
+    size_t             messageLength;
+    char               message[WEBSOCKET_MESSAGE];
+    struct websocket_client *next;
+} *websocket_client_t;
+
+static websocket_client_t websocketList = NULL;
+
+/*
+ * Existing LIRC tooling (irw, irexec, Kodi) can listen to the daemon on a
+ * Unix socket speaking the lircd protocol. Each press is formatted once and
+ * written to all clients with one vectored, non-blocking write each. Output
+ * a client cannot take right away is buffered, and a client that falls
+ * more than LIRC_CLIENT_BUFFER bytes behind is disconnected.
+ */
+#define LIRC_CLIENT_BUFFER 4096
+#define LIRC_REMOTE        "iremoted"
+
+typedef struct lirc_client
+{
+    CFSocketRef         socket;
+    CFRunLoopSourceRef  source;
+    size_t              pending;
+    char                buffer[LIRC_CLIENT_BUFFER];
+    struct lirc_client *next;
+} *lirc_client_t;
+
+static const char *lircButtonNames[NBUTTONS] = {
+    "KEY_MENU", "KEY_PLAY", "KEY_FORWARD", "KEY_REWIND",
+    "KEY_VOLUMEUP", "KEY_VOLUMEDOWN"
+};
+
+static const UInt32 lircButtonCodes[NBUTTONS] = {
+    kHIDUsage_GD_SystemAppMenu, kHIDUsage_GD_SystemMenu,
+    kHIDUsage_GD_SystemMenuRight, kHIDUsage_GD_SystemMenuLeft,
+    kHIDUsage_GD_SystemMenuUp, kHIDUsage_GD_SystemMenuDown
+};
+
+static const char    *lircPath = NULL;
+static lirc_client_t  lircClients = NULL;
+static unsigned long  lircClientCount = 0;
+static unsigned long  lircLines = 0;
+static unsigned long  lircSlowClients = 0;
+
+/*
+ * Connection records are recycled through object pools instead of going
+ * back to malloc, so clients that come and go do not fragment the heap or
+ * add allocator jitter to the run loop. A pool grows by POOL_BLOCK objects
+ * at a time up to its limit and never shrinks; freed objects are kept on a
+ * free list threaded through their first word. A connection that finds
+ * its pool at the limit is refused. Only the run loop thread allocates, so
+ * the pools need no lock. Press events and sink tasks never allocate at
+ * all: they live on the stack and in the fixed rings of the sink queues.
+ */
+#define POOL_BLOCK   8
+#define LIRC_CLIENTS 256
+
+typedef struct pool
+{
+    const char   *name;
+    size_t        size;
+    void         *free;
+    unsigned long inUse;
+    unsigned long highWater;
+    unsigned long capacity;
+    unsigned long limit;        // objects, a multiple of POOL_BLOCK
+    unsigned long refused;
+} pool_t;
+
+static pool_t controlPool = {
+    "control", sizeof(struct control_client), NULL, 0, 0, 0,
+    MAX_SUBSCRIBERS, 0
+};
+static pool_t websocketPool = {
+    "websocket", sizeof(struct websocket_client), NULL, 0, 0, 0,
+    WEBSOCKET_CLIENTS, 0
+};
+static pool_t lircPool = {
+    "lircd", sizeof(struct lirc_client), NULL, 0, 0, 0,
+    LIRC_CLIENTS, 0
+};
+
+/*
+ * Where lircd already decodes IR, its socket can be used as an input
+ * instead. The connection is a non-blocking run loop socket; lines are
+ * decoded in place in the receive buffer, and button names (ours or the
+ * KEY_ names above) go through the same keymap. lircd only reports
+ * presses and their repeats, so a new press is dispatched as a click and
+ * repeats are counted. With -H a new press is dispatched as a press only,
+ * and its release is inferred once no repeat has arrived for
+ * LIRC_RELEASE_GAP, or when another button is pressed. A lost connection
+ * is retried with exponential backoff.
+ */
+#define LIRC_INPUT_BUFFER  4096
+#define LIRC_BACKOFF_MIN   0.5     // seconds
+#define LIRC_BACKOFF_MAX   30.0
+#define LIRC_RELEASE_GAP   0.25    // seconds without a repeat, about two
+                                   // repeat frames
+
+static const char        *lircInputPath = NULL;
+static CFSocketRef        lircInputSocket = NULL;
+static CFRunLoopSourceRef lircInputSource = NULL;
+static CFRunLoopTimerRef  lircReconnectTimer = NULL;
+static double             lircBackoff = LIRC_BACKOFF_MIN;
+static int                lircInReply = 0;
+static size_t             lircInputLength = 0;
+static char               lircInputBuffer[LIRC_INPUT_BUFFER];
+static unsigned long      lircInputConnects = 0;
+static unsigned long      lircInputPresses = 0;
+static unsigned long      lircInputRepeats = 0;
+static unsigned long      lircInputUnknown = 0;
+static CFRunLoopTimerRef  lircReleaseTimer = NULL;
+static int                lircHeldButton = BUTTON_NONE;
+static UInt32             lircHeldCode = 0;
+static unsigned long      lircInferredReleases = 0;
+
+static int           websocketPort = 0;
+static rate_limit_t  websocketLimit;    // template for new clients
+static unsigned long websocketClients = 0;
+static unsigned long websocketAccepted = 0;
+static unsigned long websocketMessages = 0;
+static unsigned long websocketRejected = 0;
+static unsigned long websocketLimited = 0;  // by clients that have closed
+static unsigned long websocketRefused = 0;
+static const char   *websocketOrigins[MAX_ORIGINS];
+static int           websocketOriginCount = 0;
+
+/*
+ * A keymap file may contain "[bundle.id]" sections whose bindings apply
+ * only while that application is frontmost; buttons a section leaves
+ * unbound fall back to the default keymap. A shadow keymap may have
+ * sections too; both files share one table of application IDs, so a press
+ * is compared against the shadow section of the same application.
+ *
+ * The frontmost application is tracked from NSWorkspace's did-activate
+ * notification rather than queried per press, so dispatch only follows the
+ * cached activeKeymap pointer. NSWorkspace is reached through the
+ * Objective-C runtime so the daemon stays plain C. A faceless tool has no
+ * NSApplication, so until the first notification shows that they are
+ * delivered to the plain run loop, the owner of the frontmost window is
+ * also polled every FOCUS_POLL seconds. The stats show which of the two
+ * is in use.
+ */
+#define MAX_APPS   16
+#define APP_ID_LEN 128
+#define FOCUS_POLL 1.0                  // seconds
+
+static struct keymap   appKeymaps[MAX_APPS];
+static char            appIDs[MAX_APPS][APP_ID_LEN];
+static int             appCount = 0;
+static int             activeApp = -1;
+static char            activeAppID[APP_ID_LEN] = "";
+static unsigned long   focusChanges = 0;
+static unsigned long   focusNotifications = 0;
+static unsigned long   focusPolled = 0;     // changes found by the poll
+static CFRunLoopTimerRef focusPollTimer = NULL;
+
+static struct keymap   liveKeymap;
+static keymap_t        activeKeymap = &liveKeymap;
+static struct keymap   shadowKeymap;
+static struct keymap   shadowAppKeymaps[MAX_APPS];
+static int             shadowEnabled = 0;
+static divergence_t    divergences[DIVERGENCE_RING];
+static unsigned long   divergenceCount = 0;
+static unsigned long   divergenceKinds[NDIVERGENCES];
+static unsigned long   shadowEvaluated = 0;
+static pthread_mutex_t shadowLock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sink_queue sinkQueues[NSINKS];
+
+/*
+ * The receiver queue is drained EVENT_BATCH events per pass: reports are
+ * fetched into an array, filtered and decoded in tight loops, and then
+ * dispatched. Sink tasks produced while a batch is dispatched are staged
+ * per sink and published with one lock round trip and one schedule per
+ * sink when the batch ends. Single events (a quiet remote, WebSocket and
+ * lircd input) are published right away, so batching adds no latency.
+ * The receiver queue holds EVENT_BATCH reports, so a full batch can build
+ * up while the run loop is busy instead of being lost in the kernel.
+ * bench/batchbench.c measures the per-event cost by batch size.
+ */
+#define EVENT_BATCH 32
+
+static sink_task_t       stagedTasks[NSINKS][SINK_QUEUE_DEPTH];
+static unsigned int      stagedCount[NSINKS];
+static int               dispatchBatching = 0;
+static unsigned long     eventBatches = 0;
+static unsigned long     batchedEvents = 0;
+static int               largestBatch = 0;
+static struct worker     workers[MAX_WORKERS];
+static int               readyQueues = 0;
+static pthread_mutex_t   poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    poolWakeup = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Tasks that may not run yet (delayed by a rate limit) are kept out of the
+ * sink queues until they are due, so a delayed press neither holds back
+ * the tasks queued behind it nor ties up a worker. They wait in a min-heap
+ * ordered by notBefore, then by arrival so tasks due together keep their
+ * order, and a run loop timer stages them when the first one is due. Cue
+ * actions with an offset wait here as well, but are only submitted (rate
+ * limited and given their deadline) when due. Run loop thread only.
+ */
+#define PENDING_DEPTH 256
+#define PENDING_SLACK 500000ULL         // nanoseconds early a task may run
+
+typedef struct pending_task
+{
+    UInt64      seq;
+    int         sink;
+    int         submit;         // sinkEnqueue() when due instead of staging
+    sink_task_t task;
+} pending_task_t;
+
+static pending_task_t    pendingTasks[PENDING_DEPTH];
+static int               pendingCount = 0;
+static int               pendingMax = 0;
+static UInt64            pendingSeq = 0;
+static CFRunLoopTimerRef pendingTimer = NULL;
+
+void            usage(void);
+UInt64          ticksToNanos(UInt64 ticks);
+UInt64          nanosToTicks(UInt64 nanos);
+UInt64          nanotime(void);
+UInt64          absoluteToNanos(AbsoluteTime t);
+void            report_error(UInt64 trace, const char *msg, int code);
+int             rateLimitTake(rate_limit_t *rl, UInt64 now, UInt64 *notBefore);
+int             rateLimitApply(rate_limit_t *rl, int policy, UInt64 now,
+                               UInt64 *notBefore);
+void            parseRateLimit(const char *spec);
+int             buttonIndex(IOHIDElementCookie cookie);
+void            compileCookieTable(void);
+void            parseDeadline(const char *spec);
+OSStatus        KeynoteBuildEvent(AEEventID eventID, AppleEvent *event);
+void            prepareKeynote(void);
+OSStatus        KeynoteChangeSlide(UInt64 trace, AEEventID eventID,
+                                   long timeout);
+void           *poolGet(pool_t *pool);
+void            poolPut(pool_t *pool, void *object);
+void            raiseFileLimit(void);
+void            print_errmsg_if_io_err(int expr, char *msg);
+void            print_errmsg_if_err(int expr, char *msg);
+int             sinkIndex(const char *name, size_t len);
+UInt32          parseAction(int sink, const char *name);
+void            loadKeymap(const char *path, keymap_t keymap,
+                           keymap_t appKeymap);
+void            loadCues(const char *path);
+void            cueGo(UInt64 trace, UInt64 pressTime, UInt64 notBefore);
+void            defaultKeymap(keymap_t keymap);
+void            finishKeymaps(void);
+void            inheritKeymap(keymap_t app, keymap_t base);
+id              objcSend(id receiver, const char *selector);
+id              autoreleasePool(void);
+void            appBundleID(id app, char *bundleID, size_t size);
+void            selectApp(const char *bundleID);
+void            updateActiveApp(void);
+void            FrontAppNotification(id self, SEL command, id notification);
+void            FocusPollCallback(CFRunLoopTimerRef timer, void *info);
+void            startFocusTracking(void);
+bool            prepareKeyEvents(CGKeyCode keycode);
+void            prepareKeyboard(void);
+CGEventRef      ProbeTapCallback(CGEventTapProxy proxy, CGEventType type,
+                                 CGEventRef event, void *refcon);
+int             compareLatency(const void *a, const void *b);
+void            probeKeyboard(FILE *out);
+void           *probeMain(void *arg);
+int             startProbe(void);
+void           *benchLoadMain(void *arg);
+void            printLatency(FILE *out, const char *name, UInt64 *samples,
+                             int n);
+void            benchInjection(FILE *out);
+void            loadTuneJournal(int room);
+void           *tuneMain(void *arg);
+void            tuneJournals(FILE *out);
+OSStatus        ArrowsExecute(sink_task_t *task);
+OSStatus        KeynoteExecute(sink_task_t *task);
+OSStatus        ShadowExecute(sink_task_t *task);
+void            workerPush(worker_t w, sink_queue_t q);
+UInt64          queueDeadline(sink_queue_t q);
+int             earliestQueue(worker_t w);
+sink_queue_t    workerPop(worker_t w);
+sink_queue_t    workerSteal(worker_t self);
+void           *workerMain(void *arg);
+void            startWorkers(void);
+int             pendingBefore(pending_task_t *a, pending_task_t *b);
+void            pendingPush(int sink, sink_task_t *task, int submit);
+void            pendingPop(void);
+void            pendingSchedule(void);
+void            PendingTimerCallback(CFRunLoopTimerRef timer, void *info);
+void            sinkStage(int sink, UInt64 trace, UInt64 notBefore,
+                          UInt64 deadline, UInt32 action);
+int             sinkSubmit(int sink, UInt64 trace, UInt64 pressTime,
+                           UInt64 notBefore, UInt64 budget, UInt32 action,
+                           UInt64 *runAt);
+void            sinkEnqueue(int sink, UInt64 trace, UInt64 pressTime,
+                            UInt64 notBefore, UInt64 budget, UInt32 action);
+void            keyRelease(int button, UInt64 trace);
+void            releaseKeys(void);
+void            requeueReleases(sink_queue_t q);
+void            checkKeysUp(void);
+void            sinkPublish(int sink);
+void            dispatchFlush(void);
+void            printStats(FILE *out);
+void            StatsTimerCallback(CFRunLoopTimerRef timer, void *info);
+void            controlClose(control_client_t client);
+void            subscriberSet(subscriber_set_t set, int slot, int on);
+int             formatEvent(char *line, UInt64 seq, history_event_t *e);
+UInt32          parseNameSet(char *list, const char **names, int count,
+                             int shift);
+int             controlFlush(control_client_t client);
+int             controlSend(control_client_t client);
+void            controlPublish(void);
+int             controlSubscribe(control_client_t client, const char *args);
+void            controlCommand(control_client_t client, const char *command);
+void            ControlReadCallback(CFSocketRef s, CFSocketCallBackType type,
+                                    CFDataRef address, const void *data,
+                                    void *info);
+void            ControlAcceptCallback(CFSocketRef s, CFSocketCallBackType type,
+                                      CFDataRef address, const void *data,
+                                      void *info);
+void            startControl(void);
+UInt64          clockAlign(clock_domain_t *clock, double remote,
+                           UInt64 arrival);
+void            sha1(const void *data, size_t length,
+                     unsigned char digest[SHA1_LENGTH]);
+void            base64Encode(const unsigned char *in, size_t length,
+                             char *out);
+void            websocketClose(websocket_client_t client);
+const char     *httpHeader(const char *request, const char *end,
+                           const char *name, size_t *length);
+int             websocketRefuse(websocket_client_t client, const char *status);
+int             websocketHandshake(websocket_client_t client);
+void            websocketMessage(websocket_client_t client, const char *text,
+                                 size_t length);
+int             websocketFail(int fd, UInt16 status);
+int             websocketFrames(websocket_client_t client);
+void            WebSocketReadCallback(CFSocketRef s, CFSocketCallBackType type,
+                                      CFDataRef address, const void *data,
+                                      void *info);
+void            WebSocketAcceptCallback(CFSocketRef s,
+                                        CFSocketCallBackType type,
+                                        CFDataRef address, const void *data,
+                                        void *info);
+void            startWebSocket(void);
+void            lircClose(lirc_client_t client);
+int             lircWrite(lirc_client_t client, const char *line,
+                          size_t length);
+void            lircBroadcast(int button, int repeat);
+void            LircCallback(CFSocketRef s, CFSocketCallBackType type,
+                             CFDataRef address, const void *data, void *info);
+void            LircAcceptCallback(CFSocketRef s, CFSocketCallBackType type,
+                                   CFDataRef address, const void *data,
+                                   void *info);
+void            startLirc(void);
+void            lircInputLine(char *line);
+void            lircRelease(void);
+void            LircReleaseCallback(CFRunLoopTimerRef timer, void *info);
+void            lircInputDisconnect(void);
+void            LircInputCallback(CFSocketRef s, CFSocketCallBackType type,
+                                  CFDataRef address, const void *data,
+                                  void *info);
+void            LircReconnectCallback(CFRunLoopTimerRef timer, void *info);
+void            startLircInput(void);
+void            dispatchEvent(int source, UInt32 code, int button,
+                              SInt32 value, UInt64 timestamp,
+                              UInt64 notBefore);
+void            QueueCallbackFunction(void *target, IOReturn result,
+                                      void *refcon, void *sender);
+bool            addQueueCallbacks(IOHIDQueueInterface **hqi);
+IOHIDQueueInterface **processQueue(IOHIDDeviceInterface **hidDeviceInterface,
+                                   cookie_struct_t cookies);
+void            stopQueue(IOHIDQueueInterface **queue);
+bool            attachDevice(void);
+void            detachDevice(void);
+void            suspendTimers(bool suspend);
+void            reattach(void);
+void            ReattachTimerCallback(CFRunLoopTimerRef timer, void *info);
+void            PowerCallback(void *refcon, io_service_t service,
+                              natural_t messageType, void *messageArgument);
+void            startPower(void);
+void            sessionBegin(void);
+void            sessionEnd(void);
+void            sessionPress(void);
+void            SessionTimerCallback(CFRunLoopTimerRef timer, void *info);
+void            startSessions(void);
+cookie_struct_t getHIDCookies(IOHIDDeviceInterface122 **handle);
+void            createHIDDeviceInterface(io_object_t hidDevice,
+                                         IOHIDDeviceInterface ***hdi);
+void            setupAndRun(void);
+
+void
+usage(void)
+{
+    printf("%s (version %s)\n", PROGNAME, PROGVERS);
+    printf("Copyright (c) 2006-2008 Amit Singh. All Rights Reserved.\n");
+    printf("Displays events received from the Apple Infrared Remote.\n\n");
+    printf("Keyboard arrow event extension (c) 2013 by Manuel Peuster <manuel@peuster.de>.\n\n");
+    printf("Usage: %s [OPTIONS...]\n\nOptions:\n", PROGNAME);
+    printf("  -h, --help    print this help message and exit\n");
+    printf("  -k, --keynote use forward/backward button presses for Keynote slide transition\n\n");
+    printf("  -a, --arrows use forward/backward/up/down button presses to generate the corresponding \n\t\tkeyboard arrow events (e.g. for Preview.app slide transition)\n\n");
+    printf("  -H, --hold    pass holds through: arrow keys go down on press and up on release\n"
+           "\t\t(lircd releases are inferred when the repeats stop)\n");
+    printf("  -s, --stats=SECONDS print sink and worker statistics to stderr every SECONDS\n");
+    printf("  -w, --workers=N number of sink worker threads (default: one per sink, at most one per CPU)\n");
+    printf("  -j, --journal=FILE append every event and sink result, tagged with its trace ID, to FILE\n");
+    printf("  -r, --rate-limit=[BUTTON:|SINK:|websocket:]RATE[/BURST] allow at most RATE presses per\n"
+           "\t\tsecond per button (or for the given button, sink or WebSocket client only),\n"
+           "\t\twith bursts of up to BURST; may be repeated\n");
+    printf("  -p, --rate-policy=drop|coalesce|delay what to do with presses over the rate limit (default: drop)\n");
+    printf("  -d, --deadline=[SINK:]MS drop actions not executed within MS milliseconds of the press\n");
+    printf("  -m, --keymap=FILE bind buttons to sink actions as listed in FILE, one\n"
+           "\t\t\"BUTTON SINK ACTION [DEADLINE-MS]\" per line; entries after a \"[bundle.id]\"\n"
+           "\t\tline apply only while that application is frontmost\n");
+    printf("  -M, --shadow-keymap=FILE evaluate the keymap in FILE alongside the live one\n"
+           "\t\twithout executing it, and report where the two differ\n");
+    printf("  -i, --inject=auto|hid|session|annotated where to post keystrokes; auto picks the\n"
+           "\t\tfastest working point at startup (default: annotated)\n");
+    printf("  -q, --cues=FILE make next/previous GO/BACK through the cue list in FILE: \"cue NAME\"\n"
+           "\t\tlines followed by \"SINK ACTION [OFFSET-MS]\" lines\n");
+    printf("  -b, --bench=ROUNDS[/LOAD] measure the latency of ROUNDS presses from a loopback\n"
+           "\t\tlircd input to an event tap, with LOAD busy threads, and exit\n");
+    printf("  -T, --tune=JOURNAL replay the presses in JOURNAL under a grid of rate limits and\n"
+           "\t\tsuggest one per device, then exit; may be repeated, one journal per room\n");
+    printf("  -P, --presentation=SECONDS keep the input thread responsive from a mapped press until\n"
+           "\t\tno press has arrived for SECONDS\n");
+    printf("  -c, --control=PATH accept \"stats\", \"probe\", \"subscribe\" and, with -q, \"go\",\n"
+           "\t\t\"back\" and \"cue N\" commands on the Unix socket PATH\n");
+    printf("  -W, --websocket=PORT accept button presses from WebSocket clients on 127.0.0.1:PORT\n");
+    printf("  -O, --origin=ORIGIN accept WebSocket clients from web pages at ORIGIN, such as\n"
+           "\t\thttps://remote.example.org; may be repeated\n");
+    printf("  -l, --lircd=PATH serve button presses to LIRC clients on the Unix socket PATH\n");
+    printf("  -L, --lircd-input=PATH read button presses from the lircd socket PATH\n\n");
+    printf("Please report bugs using the following contact information:\n"
+           "<URL:http://www.osxbook.com/software/bugs/>\n");
+}
+
+UInt64
+ticksToNanos(UInt64 ticks)
+{
+    static mach_timebase_info_data_t timebase;
+
+    if (timebase.denom == 0)
+        (void)mach_timebase_info(&timebase);
+
+    return ticks * timebase.numer / timebase.denom;
+}
+
+UInt64
+nanosToTicks(UInt64 nanos)
+{
+    static mach_timebase_info_data_t timebase;
+
+    if (timebase.denom == 0)
+        (void)mach_timebase_info(&timebase);
+
+    return nanos * timebase.denom / timebase.numer;
+}
+
+UInt64
+nanotime(void)
+{
+    return ticksToNanos(mach_absolute_time());
+}
+
+UInt64
+absoluteToNanos(AbsoluteTime t)
+{
+    return ticksToNanos(((UInt64)t.hi << 32) | t.lo);
+}
+
+void
+report_error(UInt64 trace, const char *msg, int code)
+{
+    error_record_t *r = NULL;
+    UInt64          now = nanotime();
+    int             i;
+
+    pthread_mutex_lock(&errorLock);
+    for (i = 0; i < errorRecordCount; i++) {
+        if (errorRecords[i].code == code) {
+            r = &errorRecords[i];
+            break;
+        }
+    }
+    if (!r && errorRecordCount < ERROR_CODES) {
+        r = &errorRecords[errorRecordCount++];
+        r->code = code;
+    }
+    if (!r) {
+        errorOverflow++;
+        pthread_mutex_unlock(&errorLock);
+        return;
+    }
+
+    r->count++;
+    if (r->lastReport && now - r->lastReport < ERROR_REPORT_INTERVAL) {
+        r->suppressed++;
+        pthread_mutex_unlock(&errorLock);
+        return;
+    }
+    if (r->suppressed)
+        fprintf(stderr, "trace %llu: %s (error %d, %lu similar suppressed).\n",
+                trace, msg, code, r->suppressed);
+    else
+        fprintf(stderr, "trace %llu: %s (error %d).\n", trace, msg, code);
+    fflush(stderr);
+    r->suppressed = 0;
+    r->lastReport = now;
+    pthread_mutex_unlock(&errorLock);
+}
+
+/*
+ * Take a token from the bucket. Returns 1 if the press may proceed, in
+ * which case *notBefore is raised to the time it may execute (only ever in
+ * the future under the delay and coalesce policies), or 0 if it has to be
+ * discarded.
+ */
+int
+rateLimitTake(rate_limit_t *rl, UInt64 now, UInt64 *notBefore)
+{
+    return rateLimitApply(rl, ratePolicy, now, notBefore);
+}
+
+int
+rateLimitApply(rate_limit_t *rl, int policy, UInt64 now, UInt64 *notBefore)
+{
+    UInt64 tat, base, wait;
+
+    if (rl->interval == 0)
+        return 1;
+
+    tat = atomic_load_explicit(&rl->tat, memory_order_relaxed);
+    do {
+        base = (tat > now) ? tat : now;
+        wait = (base - now > rl->tolerance) ? base - now - rl->tolerance : 0;
+        if (wait && (policy == RATE_DROP ||
+                     (policy == RATE_COALESCE &&
+                      atomic_load_explicit(&rl->pending,
+                                           memory_order_relaxed) > now))) {
+            atomic_fetch_add_explicit(&rl->limited, 1, memory_order_relaxed);
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&rl->tat, &tat,
+                 base + rl->interval,
+                 memory_order_relaxed, memory_order_relaxed));
+
+    if (!wait)
+        return 1;
+
+    atomic_fetch_add_explicit(&rl->limited, 1, memory_order_relaxed);
+    if (policy == RATE_COALESCE)
+        atomic_store_explicit(&rl->pending, now + wait, memory_order_relaxed);
+    if (*notBefore < now + wait)
+        *notBefore = now + wait;
+
+    return 1;
+}
+
+void
+parseRateLimit(const char *spec)
+{
+    rate_limit_t *limits[NBUTTONS];
+    const char   *colon = strchr(spec, ':');
+    char         *end;
+    double        rate;
+    long          burst = 1;
+    int           i, n = 0;
+
+    if (colon && strncmp(spec, "websocket:", colon - spec + 1) == 0) {
+        limits[n++] = &websocketLimit;
+        spec = colon + 1;
+    } else if (colon) {
+        for (i = 0; i < NBUTTONS; i++)
+            if (strncmp(spec, buttonNames[i], colon - spec) == 0 &&
+                buttonNames[i][colon - spec] == '\0')
+                limits[n++] = &buttonLimits[i];
+        if ((i = sinkIndex(spec, colon - spec)) >= 0)
+            limits[n++] = &sinkQueues[i].limit;
+        spec = colon + 1;
+    } else {
+        for (i = 0; i < NBUTTONS; i++)
+            limits[n++] = &buttonLimits[i];
+    }
+
+    rate = strtod(spec, &end);
+    if (*end == '/')
+        burst = strtol(end + 1, &end, 10);
+    if (n == 0 || rate <= 0 || burst < 1 || *end != '\0') {
+        fprintf(stderr, "Invalid rate limit.\n");
+        usage();
+        exit(1);
+    }
+
+    for (i = 0; i < n; i++) {
+        limits[i]->interval = (UInt64)(1e9 / rate);
+        limits[i]->tolerance = (burst - 1) * limits[i]->interval;
+    }
+}
+
+int
+buttonIndex(IOHIDElementCookie cookie)
+{
+    if (cookie < COOKIE_TABLE_SIZE)
+        return cookieTable[cookie].button;
+
+    // cookies beyond the table are not expected, but still resolve them
+    if (cookie == buttonMenuID)
+        return BUTTON_MENU;
+    else if (cookie == buttonSelectID)
+        return BUTTON_SELECT;
+    else if (cookie == buttonNextID)
+        return BUTTON_NEXT;
+    else if (cookie == buttonPreviousID)
+        return BUTTON_PREVIOUS;
+    else if (cookie == buttonUpID)
+        return BUTTON_UP;
+    else if (cookie == buttonDownID)
+        return BUTTON_DOWN;
+
+    return BUTTON_NONE;
+}
+
+void
+compileCookieTable(void)
+{
+    IOHIDElementCookie ids[NBUTTONS];
+    int                i;
+
+    ids[BUTTON_MENU] = buttonMenuID;
+    ids[BUTTON_SELECT] = buttonSelectID;
+    ids[BUTTON_NEXT] = buttonNextID;
+    ids[BUTTON_PREVIOUS] = buttonPreviousID;
+    ids[BUTTON_UP] = buttonUpID;
+    ids[BUTTON_DOWN] = buttonDownID;
+
+    for (i = 0; i < COOKIE_TABLE_SIZE; i++) {
+        cookieTable[i].button = BUTTON_NONE;
+        cookieTable[i].releases = false;
+        cookieTable[i].value = -1;
+    }
+    for (i = 0; i < NBUTTONS; i++)
+        if (ids[i] && ids[i] < COOKIE_TABLE_SIZE)
+            cookieTable[ids[i]].button = i;
+}
+
+void
+parseDeadline(const char *spec)
+{
+    const char *colon = strchr(spec, ':');
+    char       *end;
+    long        ms;
+    int         i, n = 0;
+
+    ms = strtol(colon ? colon + 1 : spec, &end, 10);
+    if (ms <= 0 || *end != '\0') {
+        fprintf(stderr, "Invalid deadline.\n");
+        usage();
+        exit(1);
+    }
+
+    for (i = 0; i < NMAPPEDSINKS; i++) {
+        if (colon && i != sinkIndex(spec, colon - spec))
+            continue;
+        sinkQueues[i].budget = (UInt64)ms * 1000000ULL;
+        n++;
+    }
+    if (n == 0) {
+        fprintf(stderr, "Unknown sink in deadline.\n");
+        usage();
+        exit(1);
+    }
+}
+
+int
+sinkIndex(const char *name, size_t len)
+{
+    int i;
+
+    for (i = 0; i < NMAPPEDSINKS; i++)
+        if (strncmp(name, sinkNames[i], len) == 0 && sinkNames[i][len] == '\0')
+            return i;
+
+    return -1;
+}
+
+UInt32
+parseAction(int sink, const char *name)
+{
+    char *end;
+    long  keycode;
+
+    switch (sink) {
+    case SINK_ARROWS:
+        if (strcmp(name, "right") == 0)
+            return 124;
+        else if (strcmp(name, "left") == 0)
+            return 123;
+        else if (strcmp(name, "up") == 0)
+            return 126;
+        else if (strcmp(name, "down") == 0)
+            return 125;
+        keycode = strtol(name, &end, 0);
+        // key code 0 ('a') cannot be bound, it marks unmapped entries
+        return (*end == '\0' && keycode > 0 && keycode < 128) ? keycode : 0;
+    case SINK_KEYNOTE:
+        if (strcmp(name, "next") == 0)
+            return slideForward;
+        else if (strcmp(name, "previous") == 0)
+            return slideBackward;
+        return 0;
+    }
+
+    return 0;
+}
+
+void
+loadKeymap(const char *path, keymap_t keymap, keymap_t appKeymap)
+{
+    FILE    *file;
+    keymap_t target = keymap;
+    char     line[256];
+    char     button[32], sink[32], action[32];
+    char    *section, *close;
+    long     ms;
+    int      lineno = 0, fields, end, b, k;
+    UInt32   a;
+
+    if ((file = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Failed to open keymap %s.\n", path);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        lineno++;
+        if (line[strspn(line, " \t\r\n")] == '\0' ||
+            line[strspn(line, " \t")] == '#')
+            continue;
+
+        section = line + strspn(line, " \t");
+        if (*section == '[') {
+            close = strchr(++section, ']');
+            if (!close || close == section ||
+                close - section >= APP_ID_LEN) {
+                fprintf(stderr, "%s:%d: invalid application section.\n",
+                        path, lineno);
+                exit(1);
+            }
+            *close = '\0';
+            for (b = 0; b < appCount; b++)
+                if (strcmp(appIDs[b], section) == 0)
+                    break;
+            if (b == appCount) {
+                print_errmsg_if_err(appCount == MAX_APPS,
+                                    "Too many application sections");
+                strcpy(appIDs[appCount++], section);
+            }
+            target = &appKeymap[b];
+            continue;
+        }
+
+        // only a comment may follow the fields
+        ms = 0;
+        end = 0;
+        fields = sscanf(line, "%31s %31s %31s%n %ld%n", button, sink, action,
+                        &end, &ms, &end);
+        end += strspn(line + end, " \t\r\n");
+        for (b = 0; b < NBUTTONS; b++)
+            if (strcmp(button, buttonNames[b]) == 0)
+                break;
+        k = sinkIndex(sink, strlen(sink));
+        a = (k >= 0) ? parseAction(k, action) : 0;
+        if (fields < 3 || (line[end] != '\0' && line[end] != '#') ||
+            b == NBUTTONS || k < 0 || a == 0 || ms < 0) {
+            fprintf(stderr, "%s:%d: invalid keymap entry.\n", path, lineno);
+            exit(1);
+        }
+
+        target->map[b][k].action = a;
+        target->map[b][k].budget = (UInt64)ms * 1000000ULL;
+    }
+
+    fclose(file);
+}
+
+void
+loadCues(const char *path)
+{
+    FILE         *file;
+    cue_t        *cue = NULL;
+    cue_action_t  action;
+    char          line[256];
+    char          sink[32], name[32];
+    long          ms;
+    int           lineno = 0, fields, i;
+
+    if ((file = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Failed to open cue list %s.\n", path);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        lineno++;
+        if (line[strspn(line, " \t\r\n")] == '\0' ||
+            line[strspn(line, " \t")] == '#')
+            continue;
+
+        if (sscanf(line, "%31s", sink) == 1 && strcmp(sink, "cue") == 0) {
+            if (cueCount == MAX_CUES) {
+                fprintf(stderr, "%s:%d: too many cues.\n", path, lineno);
+                exit(1);
+            }
+            cue = &cues[cueCount++];
+            if (sscanf(line, "%*s %31[^\r\n]", cue->name) != 1)
+                snprintf(cue->name, CUE_NAME, "%d", cueCount);
+            continue;
+        }
+
+        ms = 0;
+        fields = sscanf(line, "%31s %31s %ld", sink, name, &ms);
+        action.sink = sinkIndex(sink, strlen(sink));
+        action.action = (action.sink >= 0) ? parseAction(action.sink, name) : 0;
+        action.offset = (UInt64)ms * 1000000ULL;
+        if (!cue || fields < 2 || action.action == 0 || ms < 0 ||
+            cue->count == MAX_CUE_ACTIONS) {
+            fprintf(stderr, "%s:%d: invalid cue action.\n", path, lineno);
+            exit(1);
+        }
+
+        // keep the actions ordered by offset
+        for (i = cue->count++; i > 0 && cue->actions[i - 1].offset >
+                                        action.offset; i--)
+            cue->actions[i] = cue->actions[i - 1];
+        cue->actions[i] = action;
+    }
+
+    fclose(file);
+    print_errmsg_if_err(cueCount == 0, "Cue list is empty");
+}
+
+/*
+ * Fire the cue on standby and put the next one on standby. Actions with
+ * an offset wait on the pending timer and are submitted when due, so they
+ * never sit in a sink queue ahead of live presses. A cue fires whole: its
+ * actions bypass the sink rate limits, and only the button rate limit on
+ * GO itself applies. The fire latency runs
+ * from the press to the last task being queued or scheduled.
+ */
+void
+cueGo(UInt64 trace, UInt64 pressTime, UInt64 notBefore)
+{
+    cue_t        *cue;
+    cue_action_t *a;
+    sink_task_t   task;
+    UInt64        latency, due;
+    int           i;
+
+    if (cueStandby >= cueCount)
+        return;
+    cue = &cues[cueStandby++];
+    for (i = 0, a = cue->actions; i < cue->count; i++, a++) {
+        due = (notBefore > pressTime + a->offset) ? notBefore :
+                                                    pressTime + a->offset;
+        if (due <= nanotime() + PENDING_SLACK) {
+            sinkEnqueue(a->sink, trace, due, 0, 0, a->action);
+            continue;
+        }
+        task.trace = trace;
+        task.notBefore = due;
+        task.deadline = 0;
+        task.action = a->action;
+        pendingPush(a->sink, &task, 1);
+    }
+
+    latency = nanotime() - pressTime;
+    cuesFired++;
+    cueLatencyLast = latency;
+    cueLatencyTotal += latency;
+    if (latency > cueLatencyMax)
+        cueLatencyMax = latency;
+    printf("cue %d %s (trace %llu)\n", cueStandby, cue->name, trace);
+    if (journal)
+        fprintf(journal, "C %llu %d\n", trace, cueStandby);
+}
+
+void
+finishKeymaps(void)
+{
+    int i;
+
+    for (i = 0; i < appCount; i++) {
+        inheritKeymap(&appKeymaps[i], &liveKeymap);
+        inheritKeymap(&shadowAppKeymaps[i], &shadowKeymap);
+    }
+}
+
+/*
+ * Give the buttons an application section leaves unbound the bindings of
+ * the default keymap.
+ */
+void
+inheritKeymap(keymap_t app, keymap_t base)
+{
+    int b, k;
+
+    for (b = 0; b < NBUTTONS; b++) {
+        for (k = 0; k < NMAPPEDSINKS; k++)
+            if (app->map[b][k].action)
+                break;
+        if (k == NMAPPEDSINKS)
+            memcpy(app->map[b], base->map[b], sizeof(base->map[b]));
+    }
+}
+
+id
+objcSend(id receiver, const char *selector)
+{
+    return ((id (*)(id, SEL))objc_msgSend)(receiver,
+                                           sel_registerName(selector));
+}
+
+id
+autoreleasePool(void)
+{
+    return objcSend(objcSend((id)objc_getClass("NSAutoreleasePool"), "alloc"),
+                    "init");
+}
+
+/*
+ * Copy the bundle ID of an NSRunningApplication, "" if it has none.
+ */
+void
+appBundleID(id app, char *bundleID, size_t size)
+{
+    CFStringRef string;
+
+    bundleID[0] = '\0';
+    if (app && (string = (CFStringRef)objcSend(app, "bundleIdentifier")) &&
+        !CFStringGetCString(string, bundleID, size, kCFStringEncodingUTF8))
+        bundleID[0] = '\0';
+}
+
+void
+selectApp(const char *bundleID)
+{
+    int i;
+
+    snprintf(activeAppID, sizeof(activeAppID), "%s", bundleID);
+    activeApp = -1;
+    activeKeymap = &liveKeymap;
+    for (i = 0; i < appCount; i++)
+        if (strcmp(activeAppID, appIDs[i]) == 0) {
+            activeApp = i;
+            activeKeymap = &appKeymaps[i];
+            break;
+        }
+    focusChanges++;
+}
+
+void
+updateActiveApp(void)
+{
+    char bundleID[APP_ID_LEN];
+    id   pool = autoreleasePool();
+
+    appBundleID(objcSend(objcSend((id)objc_getClass("NSWorkspace"),
+                                  "sharedWorkspace"), "frontmostApplication"),
+                bundleID, sizeof(bundleID));
+    (void)objcSend(pool, "drain");
+    selectApp(bundleID);
+}
+
+void
+FrontAppNotification(id self, SEL command, id notification)
+{
+    char bundleID[APP_ID_LEN];
+    id   pool = autoreleasePool(), app;
+
+    // notifications arrive, so the poll is not needed
+    if (focusPollTimer) {
+        CFRunLoopTimerInvalidate(focusPollTimer);
+        CFRelease(focusPollTimer);
+        focusPollTimer = NULL;
+    }
+    focusNotifications++;
+    app = ((id (*)(id, SEL, id))objc_msgSend)(
+              objcSend(notification, "userInfo"),
+              sel_registerName("objectForKey:"),
+              (id)NSWorkspaceApplicationKey);
+    appBundleID(app, bundleID, sizeof(bundleID));
+    (void)objcSend(pool, "drain");
+    selectApp(bundleID);
+}
+
+/*
+ * The window list is ordered front to back; the owner of the first window
+ * at the normal level is the application in front. It does not depend on
+ * NSWorkspace, so it works whether or not its notifications arrive.
+ */
+void
+FocusPollCallback(CFRunLoopTimerRef timer, void *info)
+{
+    CFArrayRef      windows;
+    CFDictionaryRef window;
+    CFNumberRef     number;
+    char            bundleID[APP_ID_LEN];
+    id              pool, app = nil;
+    CFIndex         i;
+    int             layer, pid = 0;
+
+    windows = CGWindowListCopyWindowInfo(kCGWindowListOptionOnScreenOnly |
+                                         kCGWindowListExcludeDesktopElements,
+                                         kCGNullWindowID);
+    if (!windows)
+        return;
+    for (i = 0; i < CFArrayGetCount(windows) && !pid; i++) {
+        window = CFArrayGetValueAtIndex(windows, i);
+        if ((number = CFDictionaryGetValue(window, kCGWindowLayer)) &&
+            CFNumberGetValue(number, kCFNumberIntType, &layer) &&
+            layer == 0 &&
+            (number = CFDictionaryGetValue(window, kCGWindowOwnerPID)))
+            (void)CFNumberGetValue(number, kCFNumberIntType, &pid);
+    }
+    CFRelease(windows);
+    if (!pid)
+        return;
+
+    pool = autoreleasePool();
+    app = ((id (*)(id, SEL, pid_t))objc_msgSend)(
+              (id)objc_getClass("NSRunningApplication"),
+              sel_registerName("runningApplicationWithProcessIdentifier:"),
+              (pid_t)pid);
+    appBundleID(app, bundleID, sizeof(bundleID));
+    (void)objcSend(pool, "drain");
+    if (app && strcmp(bundleID, activeAppID) != 0) {
+        focusPolled++;
+        selectApp(bundleID);
+    }
+}
+
+void
+startFocusTracking(void)
+{
+    Class observerClass;
+    id    workspace, observer;
+
+    if (appCount == 0)
+        return;
+
+    workspace = objcSend((id)objc_getClass("NSWorkspace"), "sharedWorkspace");
+    observerClass = objc_allocateClassPair(objc_getClass("NSObject"),
+                                           "IRFocusObserver", 0);
+    if (!workspace || !observerClass ||
+        !class_addMethod(observerClass, sel_registerName("frontSwitched:"),
+                         (IMP)FrontAppNotification, "v@:@")) {
+        fprintf(stderr, "Failed to track the frontmost application, "
+                "using the default keymap.\n");
+        return;
+    }
+    objc_registerClassPair(observerClass);
+    observer = objcSend(objcSend((id)observerClass, "alloc"), "init");
+    ((void (*)(id, SEL, id, SEL, id, id))objc_msgSend)(
+        objcSend(workspace, "notificationCenter"),
+        sel_registerName("addObserver:selector:name:object:"), observer,
+        sel_registerName("frontSwitched:"),
+        (id)NSWorkspaceDidActivateApplicationNotification, nil);
+    updateActiveApp();
+
+    focusPollTimer = CFRunLoopTimerCreate(NULL,
+                         CFAbsoluteTimeGetCurrent() + FOCUS_POLL, FOCUS_POLL,
+                         0, 0, FocusPollCallback, NULL);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), focusPollTimer,
+                      kCFRunLoopDefaultMode);
+}
+
+void
+defaultKeymap(keymap_t keymap)
+{
+    if (driveKeyboardArrows) {
+        keymap->map[BUTTON_NEXT][SINK_ARROWS].action = 124;     // right
+        keymap->map[BUTTON_PREVIOUS][SINK_ARROWS].action = 123; // left
+        keymap->map[BUTTON_UP][SINK_ARROWS].action = 126;       // up
+        keymap->map[BUTTON_DOWN][SINK_ARROWS].action = 125;     // down
+    }
+    if (driveKeynote) {
+        keymap->map[BUTTON_NEXT][SINK_KEYNOTE].action = slideForward;
+        keymap->map[BUTTON_PREVIOUS][SINK_KEYNOTE].action = slideBackward;
+    }
+}
+
+OSStatus
+KeynoteBuildEvent(AEEventID eventID, AppleEvent *event)
+{
+    AEBuildError eventBuildError;
+
+    return AEBuildAppleEvent(
+              keynoteEventClass,     // Event class for the resulting event
+              eventID,               // Event ID for the resulting event
+              typeApplicationBundleID,
+              keynoteID,
+              strlen(keynoteID),
+              kAutoGenerateReturnID, // Return ID for the created event
+              kAnyTransactionID,     // Transaction ID for this event
+              event,                 // Pointer to location for storing result
+              &eventBuildError,      // Pointer to error structure
+              "",                    // AEBuild format string describing the
+              NULL                   // AppleEvent record to be created
+        );
+}
+
+/*
+ * Build the slide events once, so a press only has to send a ready event.
+ * Failures are not fatal here; KeynoteChangeSlide() retries and reports.
+ */
+void
+prepareKeynote(void)
+{
+    int i;
+
+    for (i = 0; i < KEYNOTE_EVENTS; i++)
+        (void)KeynoteBuildEvent(keynoteEventIDs[i], &keynoteEvents[i]);
+}
+
+OSStatus
+KeynoteChangeSlide(UInt64 trace, AEEventID eventID, long timeout)
+{
+    OSStatus     err = noErr;
+    AppleEvent  *eventToSend = NULL;
+    AppleEvent   eventReply  = { typeNull, nil };
+    int          i;
+
+    for (i = 0; i < KEYNOTE_EVENTS; i++)
+        if (keynoteEventIDs[i] == eventID)
+            eventToSend = &keynoteEvents[i];
+    if (!eventToSend)
+        return paramErr;
+
+    if (eventToSend->descriptorType == typeNull)
+        err = KeynoteBuildEvent(eventID, eventToSend);
+    if (err != noErr) {
+        report_error(trace, "Failed to build Apple event", (int)err);
+        return err;
+    }
+
+    err = AESend(eventToSend,
+                 &eventReply,
+                 kAEWaitReply,      // send mode (wait for reply)
+                 kAENormalPriority,
+                 timeout,
+                 nil,               // no pointer to idle function
+                 nil);              // no pointer to filter function
+    
+    if (err != noErr)
+        report_error(trace, "Failed to send Apple event", (int)err);
+
+    // The event is kept for the next press, only the reply is disposed of
+    AEDisposeDesc(&eventReply);
+
+    return err;
+}
+
+/*
+ * Returns a zeroed object, or NULL when the pool is at its limit or memory
+ * is exhausted.
+ */
+void *
+poolGet(pool_t *pool)
+{
+    char         *block;
+    unsigned long i;
+    void         *object;
+
+    if (!pool->free) {
+        if (pool->capacity >= pool->limit ||
+            (block = malloc(pool->size * POOL_BLOCK)) == NULL) {
+            pool->refused++;
+            return NULL;
+        }
+        for (i = 0; i < POOL_BLOCK; i++) {
+            *(void **)(block + i * pool->size) = pool->free;
+            pool->free = block + i * pool->size;
+        }
+        pool->capacity += POOL_BLOCK;
+    }
+    object = pool->free;
+    pool->free = *(void **)object;
+    memset(object, 0, pool->size);
+    if (++pool->inUse > pool->highWater)
+        pool->highWater = pool->inUse;
+    return object;
+}
+
+void
+poolPut(pool_t *pool, void *object)
+{
+    *(void **)object = pool->free;
+    pool->free = object;
+    pool->inUse--;
+}
+
+void
+print_errmsg_if_io_err(int expr, char *msg)
+{
+    IOReturn err = (expr);
+
+    if (err != kIOReturnSuccess) {
+        fprintf(stderr, "*** %s - %s(%x, %d).\n", msg, mach_error_string(err),
+                err, err & 0xffffff);
+        fflush(stderr);
+        exit(EX_OSERR);
+    }
+}
+
+void
+print_errmsg_if_err(int expr, char *msg)
+{
+    if (expr) {
+        fprintf(stderr, "*** %s.\n", msg);
+        fflush(stderr);
+        exit(EX_OSERR);
+    }
+}
+
+bool
+prepareKeyEvents(CGKeyCode keycode)
+{
+    if (keycode >= KEYCODES)
+        return false;
+    if (!keyDownEvents[keycode])
+        keyDownEvents[keycode] =
+            CGEventCreateKeyboardEvent(keyboardSource, keycode, true);
+    if (!keyUpEvents[keycode])
+        keyUpEvents[keycode] =
+            CGEventCreateKeyboardEvent(keyboardSource, keycode, false);
+
+    return keyDownEvents[keycode] && keyUpEvents[keycode];
+}
+
+void
+prepareKeyboard(void)
+{
+    int b, i;
+
+    keyboardSource = CGEventSourceCreate(kCGEventSourceStateHIDSystemState);
+    for (b = 0; b < NBUTTONS; b++) {
+        if (liveKeymap.map[b][SINK_ARROWS].action)
+            (void)prepareKeyEvents(liveKeymap.map[b][SINK_ARROWS].action);
+        for (i = 0; i < appCount; i++)
+            if (appKeymaps[i].map[b][SINK_ARROWS].action)
+                (void)prepareKeyEvents(appKeymaps[i].map[b][SINK_ARROWS].action);
+    }
+    for (b = 0; b < cueCount; b++)
+        for (i = 0; i < cues[b].count; i++)
+            if (cues[b].actions[i].sink == SINK_ARROWS)
+                (void)prepareKeyEvents(cues[b].actions[i].action);
+    // benchmark keys are marked so the tap can tell them from typing
+    if (benchRounds && prepareKeyEvents(PROBE_KEYCODE)) {
+        CGEventSetIntegerValueField(keyDownEvents[PROBE_KEYCODE],
+                                    kCGEventSourceUserData, PROBE_MARK);
+        CGEventSetIntegerValueField(keyUpEvents[PROBE_KEYCODE],
+                                    kCGEventSourceUserData, PROBE_MARK);
+    }
+}
+
+OSStatus
+ArrowsExecute(sink_task_t *task)
+{
+    CGKeyCode          keycode;
+    CGEventTapLocation location;
+    UInt64             now;
+    char               msg[64];
+    int                down, up;
+
+    keycode = (CGKeyCode)(task->action & ~(KEY_DOWN_ONLY | KEY_UP_ONLY));
+    down = !(task->action & KEY_UP_ONLY);
+    up = !(task->action & KEY_DOWN_ONLY);
+    if (!prepareKeyEvents(keycode)) {
+        snprintf(msg, sizeof(msg),
+                 "Failed to create keyboard event for key code %hu", keycode);
+        report_error(task->trace, msg, -1);
+        return -1;
+    }
+    // a held key goes down for its first holder and up with its last one
+    if (down && !up && keysDown[keycode]++)
+        down = 0;
+    if (up && !down && (keysDown[keycode] == 0 || --keysDown[keycode]))
+        up = 0;
+    if (down && !up)
+        atomic_fetch_add(&keysDownTotal, 1);
+    else if (up && !down)
+        atomic_fetch_sub(&keysDownTotal, 1);
+    if (!down && !up)
+        return noErr;
+
+    printf("Sending keystroke%s with CGKeyCode: %hu (trace %llu)\n",
+           up ? (down ? "" : " up") : " down", keycode, task->trace);
+    // the events are reused, so give them the current time before posting
+    now = mach_absolute_time();
+    location = injectLocations[atomic_load(&injectPoint)];
+    if (down) {
+        CGEventSetTimestamp(keyDownEvents[keycode], now);
+        CGEventPost(location, keyDownEvents[keycode]);
+    }
+    if (up) {
+        CGEventSetTimestamp(keyUpEvents[keycode], now);
+        CGEventPost(location, keyUpEvents[keycode]);
+    }
+
+    return noErr;
+}
+
+CGEventRef
+ProbeTapCallback(CGEventTapProxy proxy, CGEventType type, CGEventRef event,
+                 void *refcon)
+{
+    if (type == kCGEventKeyDown &&
+        CGEventGetIntegerValueField(event, kCGEventSourceUserData) ==
+        PROBE_MARK) {
+        probeObserved = nanotime();
+        probePosted = ticksToNanos(CGEventGetTimestamp(event));
+    }
+
+    return event;
+}
+
+int
+compareLatency(const void *a, const void *b)
+{
+    UInt64 x = *(const UInt64 *)a, y = *(const UInt64 *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Runs on the run loop thread, in a private run loop mode so that no HID or
+ * control callbacks fire while it waits for its probe keys.
+ */
+void
+probeKeyboard(FILE *out)
+{
+    CFStringRef        probeMode = CFSTR("iremoted.probe");
+    CFMachPortRef      tap;
+    CFRunLoopSourceRef tapSource;
+    CGEventRef         keyDown, keyUp;
+    UInt64             samples[PROBE_ROUNDS], start;
+    int                i, r, n, best = -1;
+
+    tap = CGEventTapCreate(kCGAnnotatedSessionEventTap, kCGTailAppendEventTap,
+                           kCGEventTapOptionListenOnly,
+                           CGEventMaskBit(kCGEventKeyDown), ProbeTapCallback,
+                           NULL);
+    keyDown = CGEventCreateKeyboardEvent(keyboardSource, PROBE_KEYCODE, true);
+    keyUp = CGEventCreateKeyboardEvent(keyboardSource, PROBE_KEYCODE, false);
+    if (!tap || !keyDown || !keyUp) {
+        fprintf(out, "Cannot probe keyboard injection, keeping %s.\n",
+                injectNames[atomic_load(&injectPoint)]);
+        if (tap)
+            CFRelease(tap);
+        if (keyDown)
+            CFRelease(keyDown);
+        if (keyUp)
+            CFRelease(keyUp);
+        return;
+    }
+    CGEventSetIntegerValueField(keyDown, kCGEventSourceUserData, PROBE_MARK);
+    CGEventSetIntegerValueField(keyUp, kCGEventSourceUserData, PROBE_MARK);
+    tapSource = CFMachPortCreateRunLoopSource(NULL, tap, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), tapSource, probeMode);
+
+    for (i = 0; i < NINJECTS; i++) {
+        for (r = n = 0; r < PROBE_ROUNDS; r++) {
+            probeObserved = 0;
+            start = nanotime();
+            CGEventSetTimestamp(keyDown, mach_absolute_time());
+            CGEventPost(injectLocations[i], keyDown);
+            while (!probeObserved && nanotime() - start < PROBE_TIMEOUT)
+                CFRunLoopRunInMode(probeMode, 0.005, true);
+            CGEventSetTimestamp(keyUp, mach_absolute_time());
+            CGEventPost(injectLocations[i], keyUp);
+            if (probeObserved)
+                samples[n++] = probeObserved - start;
+        }
+        // a point that loses half of its probes doesn't work here
+        if (n < PROBE_ROUNDS / 2) {
+            atomic_store(&probeLatency[i], 0);
+            fprintf(out, "inject %-9s not observed\n", injectNames[i]);
+            continue;
+        }
+        qsort(samples, n, sizeof(samples[0]), compareLatency);
+        atomic_store(&probeLatency[i], samples[n / 2]);
+        fprintf(out, "inject %-9s %llu ns\n", injectNames[i], samples[n / 2]);
+        if (best < 0 || samples[n / 2] < atomic_load(&probeLatency[best]))
+            best = i;
+    }
+
+    if (best >= 0)
+        atomic_store(&injectPoint, best);
+    fprintf(out, "Injecting keystrokes at %s.\n",
+            injectNames[atomic_load(&injectPoint)]);
+    fflush(out);
+
+    CFRunLoopRemoveSource(CFRunLoopGetCurrent(), tapSource, probeMode);
+    CFMachPortInvalidate(tap);
+    CFRelease(tapSource);
+    CFRelease(tap);
+    CFRelease(keyUp);
+    CFRelease(keyDown);
+}
+
+void *
+probeMain(void *arg)
+{
+    probeKeyboard(stderr);
+    atomic_store(&probeRunning, 0);
+    return NULL;
+}
+
+/*
+ * Probe the injection points on a thread of its own. Returns 0 if a probe
+ * is already running or the thread cannot be started.
+ */
+int
+startProbe(void)
+{
+    pthread_t thread;
+
+    if (atomic_exchange(&probeRunning, 1))
+        return 0;
+    if (pthread_create(&thread, NULL, probeMain, NULL) != 0) {
+        atomic_store(&probeRunning, 0);
+        return 0;
+    }
+    pthread_detach(thread);
+    injectAuto = 1;
+    return 1;
+}
+
+void *
+benchLoadMain(void *arg)
+{
+    volatile unsigned long spin = 0;
+
+    while (atomic_load_explicit(&benchLoading, memory_order_relaxed))
+        spin++;
+    return NULL;
+}
+
+void
+printLatency(FILE *out, const char *name, UInt64 *samples, int n)
+{
+    qsort(samples, n, sizeof(samples[0]), compareLatency);
+    fprintf(out, "bench %-12s min %8.1f p50 %8.1f p90 %8.1f p99 %8.1f "
+            "max %8.1f us\n", name, samples[0] / 1e3,
+            samples[(n - 1) / 2] / 1e3, samples[(n - 1) * 9 / 10] / 1e3,
+            samples[(n - 1) * 99 / 100] / 1e3, samples[n - 1] / 1e3);
+}
+
+/*
+ * Runs on the run loop thread before the receiver is attached. The run loop
+ * runs in its default mode, where the lircd input is serviced.
+ */
+void
+benchInjection(FILE *out)
+{
+    static char        path[64];
+    struct sockaddr_un addr;
+    CFMachPortRef      tap;
+    CFRunLoopSourceRef tapSource;
+    pthread_t          loaders[MAX_WORKERS * 4];
+    UInt64            *posted, *delivered, *total, start;
+    char               line[64];
+    int                i, k, n = 0, loaderCount = 0, listener, fd = -1;
+    size_t             length;
+
+    tap = CGEventTapCreate(kCGAnnotatedSessionEventTap, kCGTailAppendEventTap,
+                           kCGEventTapOptionListenOnly,
+                           CGEventMaskBit(kCGEventKeyDown), ProbeTapCallback,
+                           NULL);
+    print_errmsg_if_err(tap == NULL || !keyDownEvents[PROBE_KEYCODE],
+                        "Cannot observe injected keys");
+    posted = malloc(benchRounds * sizeof(*posted));
+    delivered = malloc(benchRounds * sizeof(*delivered));
+    total = malloc(benchRounds * sizeof(*total));
+    print_errmsg_if_err(!posted || !delivered || !total,
+                        "Failed to allocate benchmark samples");
+
+    // play lircd and let the daemon connect to us as it would with -L
+    snprintf(path, sizeof(path), "/tmp/iremoted-bench.%d", (int)getpid());
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    (void)unlink(path);
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener >= 0 &&
+        bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        listen(listener, 1) == 0) {
+        lircInputPath = path;
+        startLircInput();
+        if (lircInputSocket)
+            fd = accept(listener, NULL, NULL);
+    }
+    print_errmsg_if_err(fd < 0, "Cannot feed presses through the lircd input");
+    for (k = 0; k < NMAPPEDSINKS; k++)
+        liveKeymap.map[BENCH_BUTTON][k].action = 0;
+    liveKeymap.map[BENCH_BUTTON][SINK_ARROWS].action = PROBE_KEYCODE;
+    length = snprintf(line, sizeof(line), "%016x 00 %s iremoted\n",
+                      (unsigned int)lircButtonCodes[BENCH_BUTTON],
+                      lircButtonNames[BENCH_BUTTON]);
+
+    tapSource = CFMachPortCreateRunLoopSource(NULL, tap, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), tapSource,
+                       kCFRunLoopDefaultMode);
+
+    atomic_store(&benchLoading, 1);
+    for (i = 0; i < benchLoad && i < MAX_WORKERS * 4; i++)
+        if (pthread_create(&loaders[i], NULL, benchLoadMain, NULL) == 0)
+            loaderCount++;
+
+    for (i = 0; i < benchRounds; i++) {
+        probeObserved = 0;
+        start = nanotime();
+        if (write(fd, line, length) != (ssize_t)length)
+            break;
+        while (!probeObserved && nanotime() - start < PROBE_TIMEOUT)
+            CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.005, true);
+        if (probeObserved && probePosted >= start &&
+            probePosted <= probeObserved) {
+            posted[n] = probePosted - start;
+            delivered[n] = probeObserved - probePosted;
+            total[n++] = probeObserved - start;
+        }
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, BENCH_GAP, true);
+    }
+
+    atomic_store(&benchLoading, 0);
+    for (i = 0; i < loaderCount; i++)
+        pthread_join(loaders[i], NULL);
+
+    fprintf(out, "bench rounds %d observed %d load threads %d inject %s\n",
+            benchRounds, n, loaderCount,
+            injectNames[atomic_load(&injectPoint)]);
+    if (n) {
+        printLatency(out, "input-post", posted, n);
+        printLatency(out, "post-tap", delivered, n);
+        printLatency(out, "input-tap", total, n);
+    }
+    fflush(out);
+
+    close(fd);
+    close(listener);
+    (void)unlink(path);
+    CFRunLoopRemoveSource(CFRunLoopGetCurrent(), tapSource,
+                          kCFRunLoopDefaultMode);
+    CFMachPortInvalidate(tap);
+    CFRelease(tapSource);
+    CFRelease(tap);
+    free(total);
+    free(delivered);
+    free(posted);
+}
+
+void
+loadTuneJournal(int room)
+{
+    FILE         *file;
+    tune_event_t *grown;
+    UInt64        trace, time, last[NSOURCES][NBUTTONS];
+    char          line[256], source[16], button[16];
+    unsigned int  code;
+    size_t        allocated = tuneEventCount;
+    int           value, s, b;
+
+    if ((file = fopen(roomPaths[room], "r")) == NULL) {
+        fprintf(stderr, "Failed to open journal %s.\n", roomPaths[room]);
+        exit(1);
+    }
+    memset(last, 0, sizeof(last));
+
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "E %llu %llu %15s %x %15s %d", &trace, &time, source,
+                   &code, button, &value) != 6 || value == 0)
+            continue;
+        for (s = 0; s < NSOURCES; s++)
+            if (strcmp(source, sourceNames[s]) == 0)
+                break;
+        for (b = 0; b < NBUTTONS; b++)
+            if (strcmp(button, buttonNames[b]) == 0)
+                break;
+        if (s == NSOURCES || b == NBUTTONS)
+            continue;
+
+        if (tuneEventCount == allocated) {
+            allocated = allocated ? allocated * 2 : 1024;
+            grown = realloc(tuneEvents, allocated * sizeof(*tuneEvents));
+            print_errmsg_if_err(grown == NULL, "Failed to allocate events");
+            tuneEvents = grown;
+        }
+        tuneEvents[tuneEventCount].time = time;
+        tuneEvents[tuneEventCount].group = room * NSOURCES + s;
+        tuneEvents[tuneEventCount].button = b;
+        tuneEvents[tuneEventCount].deliberate =
+            !last[s][b] || time - last[s][b] >= TUNE_DELIBERATE;
+        tuneEventCount++;
+        last[s][b] = time;
+    }
+
+    fclose(file);
+}
+
+/*
+ * Worker thread: take parameter sets off the shared counter and replay all
+ * events under each.
+ */
+void *
+tuneMain(void *arg)
+{
+    rate_limit_t   *limits;
+    tune_set_t     *set;
+    tune_result_t  *r;
+    tune_event_t   *e;
+    keymap_entry_t *entry;
+    UInt64          notBefore, delay, budget;
+    size_t          i;
+    int             groups = roomCount * NSOURCES, n, k;
+
+    limits = calloc(groups * NBUTTONS, sizeof(*limits));
+    print_errmsg_if_err(limits == NULL, "Failed to allocate limits");
+
+    while ((n = atomic_fetch_add(&tuneNextSet, 1)) < tuneSetCount) {
+        set = &tuneSets[n];
+        memset(limits, 0, groups * NBUTTONS * sizeof(*limits));
+        for (i = 0; set->rate > 0 && i < (size_t)groups * NBUTTONS; i++) {
+            limits[i].interval = (UInt64)(1e9 / set->rate);
+            limits[i].tolerance = (set->burst - 1) * limits[i].interval;
+        }
+
+        for (i = 0, e = tuneEvents; i < tuneEventCount; i++, e++) {
+            r = &tuneResults[n * groups + e->group];
+            r->presses++;
+            r->deliberate += e->deliberate;
+            notBefore = 0;
+            if (!rateLimitApply(&limits[e->group * NBUTTONS + e->button],
+                                set->policy, e->time, &notBefore)) {
+                r->suppressed++;
+                r->lostDeliberate += e->deliberate;
+                continue;
+            }
+            delay = (notBefore > e->time) ? notBefore - e->time : 0;
+            if (delay) {
+                r->delayed++;
+                r->delayTotal += delay;
+                if (delay > r->delayMax)
+                    r->delayMax = delay;
+            }
+            for (k = 0; k < NMAPPEDSINKS; k++) {
+                entry = &liveKeymap.map[e->button][k];
+                if (!entry->action)
+                    continue;
+                r->actions++;
+                budget = entry->budget ? entry->budget : sinkQueues[k].budget;
+                if (budget && delay > budget)
+                    r->misses++;
+            }
+        }
+    }
+
+    free(limits);
+    return NULL;
+}
+
+void
+tuneJournals(FILE *out)
+{
+    pthread_t      threads[MAX_WORKERS * 4];
+    tune_result_t *r;
+    long           ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int            groups = roomCount * NSOURCES;
+    int            i, g, b, p, threadCount = 0, best;
+    size_t         ri, bi;
+
+    for (i = 0; i < roomCount; i++)
+        loadTuneJournal(i);
+    print_errmsg_if_err(tuneEventCount == 0, "No presses in the journals");
+
+    // one set without a limit, then the grid
+    tuneSetCount = 1 + (sizeof(tuneRates) / sizeof(tuneRates[0])) *
+                   (sizeof(tuneBursts) / sizeof(tuneBursts[0])) * 3;
+    tuneSets = calloc(tuneSetCount, sizeof(*tuneSets));
+    tuneResults = calloc((size_t)tuneSetCount * groups, sizeof(*tuneResults));
+    print_errmsg_if_err(!tuneSets || !tuneResults,
+                        "Failed to allocate tuner results");
+    i = 1;
+    for (ri = 0; ri < sizeof(tuneRates) / sizeof(tuneRates[0]); ri++)
+        for (bi = 0; bi < sizeof(tuneBursts) / sizeof(tuneBursts[0]); bi++)
+            for (p = RATE_DROP; p <= RATE_DELAY; p++) {
+                tuneSets[i].rate = tuneRates[ri];
+                tuneSets[i].burst = tuneBursts[bi];
+                tuneSets[i++].policy = p;
+            }
+
+    if (ncpu < 1)
+        ncpu = 1;
+    for (i = 0; i < ncpu && i < tuneSetCount && i < MAX_WORKERS * 4; i++)
+        if (pthread_create(&threads[i], NULL, tuneMain, NULL) == 0)
+            threadCount++;
+    if (threadCount == 0)
+        tuneMain(NULL);
+    for (i = 0; i < threadCount; i++)
+        pthread_join(threads[i], NULL);
+
+    for (g = 0; g < groups; g++) {
+        if (tuneResults[g].presses == 0)
+            continue;
+        fprintf(out, "room %s device %s presses %lu deliberate %lu\n",
+                roomPaths[g / NSOURCES], sourceNames[g % NSOURCES],
+                tuneResults[g].presses, tuneResults[g].deliberate);
+        fprintf(out, "  %-6s %-5s %-8s %8s %10s %6s %8s %9s %9s %6s\n",
+                "rate", "burst", "policy", "actions", "suppressed", "(lost)",
+                "delayed", "mean ms", "max ms", "misses");
+        best = -1;
+        for (i = 0; i < tuneSetCount; i++) {
+            r = &tuneResults[i * groups + g];
+            if (tuneSets[i].rate > 0)
+                fprintf(out, "  %-6g %-5d %-8s", tuneSets[i].rate,
+                        tuneSets[i].burst, policyNames[tuneSets[i].policy]);
+            else
+                fprintf(out, "  %-6s %-5s %-8s", "off", "-", "-");
+            fprintf(out, " %8lu %10lu %6lu %8lu %9.1f %9.1f %6lu\n",
+                    r->actions, r->suppressed, r->lostDeliberate, r->delayed,
+                    r->delayed ? r->delayTotal / 1e6 / r->delayed : 0.0,
+                    r->delayMax / 1e6, r->misses);
+
+            if (r->lostDeliberate * 100 > r->deliberate ||
+                r->misses * 100 > r->actions)
+                continue;
+            b = (best < 0) ? -1 : best * groups + g;
+            if (best < 0 ||
+                r->suppressed - r->lostDeliberate >
+                tuneResults[b].suppressed - tuneResults[b].lostDeliberate ||
+                (r->suppressed - r->lostDeliberate ==
+                 tuneResults[b].suppressed - tuneResults[b].lostDeliberate &&
+                 r->delayTotal < tuneResults[b].delayTotal))
+                best = i;
+        }
+        if (best > 0 &&
+            tuneResults[best * groups + g].suppressed >
+            tuneResults[best * groups + g].lostDeliberate)
+            fprintf(out, "  suggest -r %g/%d -p %s\n", tuneSets[best].rate,
+                    tuneSets[best].burst, policyNames[tuneSets[best].policy]);
+        else
+            fprintf(out, "  suggest no rate limit\n");
+    }
+    fflush(out);
+}
+
+OSStatus
+KeynoteExecute(sink_task_t *task)
+{
+    long   timeout = kNoTimeOut;
+    UInt64 now;
+
+    // don't wait for Keynote's reply past the deadline (timeout in ticks)
+    if (task->deadline) {
+        now = nanotime();
+        timeout = (task->deadline > now) ?
+                  (long)((task->deadline - now) * 60 / 1000000000ULL) : 0;
+        if (timeout < 1)
+            timeout = 1;
+    }
+
+    return KeynoteChangeSlide(task->trace, (AEEventID)task->action, timeout);
+}
+
+/*
+ * Compare what the live and the shadow keymap do for one press. The keymaps
+ * are immutable once the run loop starts, so this needs no locking beyond
+ * the divergence log.
+ */
+OSStatus
+ShadowExecute(sink_task_t *task)
+{
+    keymap_entry_t *live, *shadow;
+    keymap_t        keymap, candidate;
+    divergence_t   *d;
+    int             button = (int)(task->action & 0xff);
+    int             app = (int)(task->action >> 8) - 1;
+    int             k, kind;
+
+    // compare the keymaps of the application that was frontmost
+    keymap = (app >= 0) ? &appKeymaps[app] : &liveKeymap;
+    candidate = (app >= 0) ? &shadowAppKeymaps[app] : &shadowKeymap;
+
+    pthread_mutex_lock(&shadowLock);
+    shadowEvaluated++;
+    for (k = 0; k < NMAPPEDSINKS; k++) {
+        live = &keymap->map[button][k];
+        shadow = &candidate->map[button][k];
+        if (live->action != shadow->action)
+            kind = (live->action && shadow->action) ? DIVERGE_ACTION
+                                                    : DIVERGE_SINK;
+        else if (live->action && live->budget != shadow->budget)
+            kind = DIVERGE_TIMING;
+        else
+            continue;
+
+        d = &divergences[divergenceCount++ % DIVERGENCE_RING];
+        d->trace = task->trace;
+        d->button = button;
+        d->sink = k;
+        d->kind = kind;
+        d->live = live->action;
+        d->shadow = shadow->action;
+        divergenceKinds[kind]++;
+        if (journal)
+            fprintf(journal, "D %llu %s %s %s %u %u\n", task->trace,
+                    buttonNames[button], sinkNames[k], divergenceNames[kind],
+                    (unsigned int)live->action, (unsigned int)shadow->action);
+    }
+    pthread_mutex_unlock(&shadowLock);
+
+    return noErr;
+}
+
+void
+workerPush(worker_t w, sink_queue_t q)
+{
+    pthread_mutex_lock(&w->lock);
+    w->deque[w->count++] = q;
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&poolLock);
+    readyQueues++;
+    pthread_cond_signal(&poolWakeup);
+    pthread_mutex_unlock(&poolLock);
+}
+
+UInt64
+queueDeadline(sink_queue_t q)
+{
+    UInt64 deadline;
+
+    pthread_mutex_lock(&q->lock);
+    deadline = q->count ? q->tasks[q->head].deadline : 0;
+    pthread_mutex_unlock(&q->lock);
+
+    return deadline ? deadline : UINT64_MAX;
+}
+
+/*
+ * Index of the ready queue in w whose next task is due first, or -1. Ties
+ * (including queues without deadlines) go to the most recently pushed one
+ * so the owner keeps working on warm queues. Called with w->lock held.
+ */
+int
+earliestQueue(worker_t w)
+{
+    UInt64 deadline, best = 0;
+    int    i, found = -1;
+
+    for (i = w->count - 1; i >= 0; i--) {
+        deadline = queueDeadline(w->deque[i]);
+        if (found < 0 || deadline < best) {
+            best = deadline;
+            found = i;
+        }
+    }
+
+    return found;
+}
+
+sink_queue_t
+workerPop(worker_t w)
+{
+    sink_queue_t q = NULL;
+    int          i;
+
+    pthread_mutex_lock(&w->lock);
+    if ((i = earliestQueue(w)) >= 0) {
+        q = w->deque[i];
+        for (; i < w->count - 1; i++)
+            w->deque[i] = w->deque[i + 1];
+        w->count--;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return q;
+}
+
+sink_queue_t
+workerSteal(worker_t self)
+{
+    sink_queue_t q = NULL;
+    worker_t     victim;
+    int          i, n;
+
+    for (n = 1; n < workerCount && !q; n++) {
+        victim = &workers[((self - workers) + n) % workerCount];
+        pthread_mutex_lock(&victim->lock);
+        if ((i = earliestQueue(victim)) >= 0) {
+            q = victim->deque[i];
+            for (; i < victim->count - 1; i++)
+                victim->deque[i] = victim->deque[i + 1];
+            victim->count--;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    if (q)
+        atomic_fetch_add_explicit(&self->steals, 1, memory_order_relaxed);
+
+    return q;
+}
+
+void *
+workerMain(void *arg)
+{
+    worker_t     self = (worker_t)arg;
+    sink_queue_t q;
+    sink_task_t  task;
+    OSStatus     status;
+    int          n, more;
+
+    for (;;) {
+        if ((q = workerPop(self)) == NULL && (q = workerSteal(self)) == NULL) {
+            pthread_mutex_lock(&poolLock);
+            while (readyQueues == 0)
+                pthread_cond_wait(&poolWakeup, &poolLock);
+            pthread_mutex_unlock(&poolLock);
+            continue;
+        }
+
+        pthread_mutex_lock(&poolLock);
+        readyQueues--;
+        pthread_mutex_unlock(&poolLock);
+
+        /*
+         * Run a bounded batch so one busy sink cannot starve the others
+         * scheduled on this worker, then hand the queue back if it still
+         * holds tasks.
+         */
+        for (n = 0; n < SINK_BATCH; n++) {
+            pthread_mutex_lock(&q->lock);
+            if (q->count == 0) {
+                pthread_mutex_unlock(&q->lock);
+                break;
+            }
+            task = q->tasks[q->head];
+            q->head = (q->head + 1) % SINK_QUEUE_DEPTH;
+            q->count--;
+            if (lateReleaseCount && q == &sinkQueues[SINK_ARROWS])
+                requeueReleases(q);
+            pthread_mutex_unlock(&q->lock);
+
+            if (task.deadline && nanotime() > task.deadline) {
+                if (journal)
+                    fprintf(journal, "M %llu %s\n", task.trace, q->name);
+                pthread_mutex_lock(&q->lock);
+                q->missed++;
+                pthread_mutex_unlock(&q->lock);
+                continue;
+            }
+
+            status = q->execute(&task);
+            if (journal)
+                fprintf(journal, "R %llu %s %d\n",
+                        task.trace, q->name, (int)status);
+
+            pthread_mutex_lock(&q->lock);
+            q->executed++;
+            if (status != noErr)
+                q->failed++;
+            pthread_mutex_unlock(&q->lock);
+            atomic_fetch_add_explicit(&self->executed, 1,
+                                      memory_order_relaxed);
+        }
+
+        pthread_mutex_lock(&q->lock);
+        more = q->scheduled = (q->count > 0);
+        pthread_mutex_unlock(&q->lock);
+        if (more)
+            workerPush(self, q);
+    }
+
+    return NULL;
+}
+
+void
+startWorkers(void)
+{
+    int i;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    sinkQueues[SINK_ARROWS].execute = ArrowsExecute;
+    sinkQueues[SINK_KEYNOTE].execute = KeynoteExecute;
+    sinkQueues[SINK_SHADOW].execute = ShadowExecute;
+    for (i = 0; i < NSINKS; i++) {
+        sinkQueues[i].name = sinkNames[i];
+        pthread_mutex_init(&sinkQueues[i].lock, NULL);
+    }
+
+    if (workerCount <= 0)
+        workerCount = (ncpu > 0 && ncpu < NSINKS) ? (int)ncpu : NSINKS;
+    if (workerCount > MAX_WORKERS)
+        workerCount = MAX_WORKERS;
+
+    for (i = 0; i < workerCount; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        print_errmsg_if_err(pthread_create(&workers[i].thread, NULL,
+                                           workerMain, &workers[i]),
+                            "Failed to start sink worker");
+    }
+
+    // fires only while tasks are pending
+    pendingTimer = CFRunLoopTimerCreate(NULL,
+                       CFAbsoluteTimeGetCurrent() + 1e9, 1e9, 0, 0,
+                       PendingTimerCallback, NULL);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), pendingTimer,
+                      kCFRunLoopDefaultMode);
+}
+
+int
+pendingBefore(pending_task_t *a, pending_task_t *b)
+{
+    if (a->task.notBefore != b->task.notBefore)
+        return a->task.notBefore < b->task.notBefore;
+    return a->seq < b->seq;
+}
+
+void
+pendingPush(int sink, sink_task_t *task, int submit)
+{
+    sink_queue_t   q = &sinkQueues[sink];
+    pending_task_t t;
+    int            i;
+
+    // releases pair with presses pending before them, so half is enough
+    if (pendingCount == ((sink == SINK_ARROWS &&
+                          (task->action & KEY_UP_ONLY)) ?
+                         PENDING_DEPTH : PENDING_DEPTH / 2)) {
+        pthread_mutex_lock(&q->lock);
+        q->dropped++;
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+    t.seq = pendingSeq++;
+    t.sink = sink;
+    t.submit = submit;
+    t.task = *task;
+    for (i = pendingCount++; i > 0 &&
+                             pendingBefore(&t, &pendingTasks[(i - 1) / 2]);
+         i = (i - 1) / 2)
+        pendingTasks[i] = pendingTasks[(i - 1) / 2];
+    pendingTasks[i] = t;
+    if (pendingCount > pendingMax)
+        pendingMax = pendingCount;
+    if (i == 0)
+        pendingSchedule();
+}
+
+void
+pendingPop(void)
+{
+    pending_task_t last = pendingTasks[--pendingCount];
+    int            i, child;
+
+    for (i = 0; (child = 2 * i + 1) < pendingCount; i = child) {
+        if (child + 1 < pendingCount &&
+            pendingBefore(&pendingTasks[child + 1], &pendingTasks[child]))
+            child++;
+        if (!pendingBefore(&pendingTasks[child], &last))
+            break;
+        pendingTasks[i] = pendingTasks[child];
+    }
+    pendingTasks[i] = last;
+}
+
+void
+pendingSchedule(void)
+{
+    UInt64 now = nanotime(), due;
+
+    due = pendingCount ? pendingTasks[0].task.notBefore : now;
+    CFRunLoopTimerSetNextFireDate(pendingTimer, CFAbsoluteTimeGetCurrent() +
+                                  (pendingCount == 0 ? 1e9 :
+                                   due > now ? (due - now) / 1e9 : 0));
+}
+
+void
+PendingTimerCallback(CFRunLoopTimerRef timer, void *info)
+{
+    pending_task_t t;
+    UInt64         now = nanotime();
+    int            k;
+
+    while (pendingCount &&
+           pendingTasks[0].task.notBefore <= now + PENDING_SLACK) {
+        t = pendingTasks[0];
+        pendingPop();
+        if (t.submit)
+            sinkEnqueue(t.sink, t.task.trace, t.task.notBefore, 0, 0,
+                        t.task.action);
+        else
+            sinkStage(t.sink, t.task.trace, 0, t.task.deadline,
+                      t.task.action);
+    }
+    pendingSchedule();
+    for (k = 0; k < NSINKS; k++)
+        sinkPublish(k);
+}
+
+void
+sinkStage(int sink, UInt64 trace, UInt64 notBefore, UInt64 deadline,
+          UInt32 action)
+{
+    sink_task_t *task, delayed;
+
+    // a task delayed past its deadline cannot be on time
+    if (deadline && notBefore > deadline) {
+        if (journal)
+            fprintf(journal, "M %llu %s\n", trace, sinkNames[sink]);
+        pthread_mutex_lock(&sinkQueues[sink].lock);
+        sinkQueues[sink].missed++;
+        pthread_mutex_unlock(&sinkQueues[sink].lock);
+        return;
+    }
+    if (notBefore > nanotime() + PENDING_SLACK) {
+        delayed.trace = trace;
+        delayed.notBefore = notBefore;
+        delayed.deadline = deadline;
+        delayed.action = action;
+        pendingPush(sink, &delayed, 0);
+        return;
+    }
+    if (stagedCount[sink] == SINK_QUEUE_DEPTH)
+        sinkPublish(sink);
+    task = &stagedTasks[sink][stagedCount[sink]++];
+    task->trace = trace;
+    task->notBefore = notBefore;
+    task->deadline = deadline;
+    task->action = action;
+}
+
+/*
+ * Returns 0 if the sink rate limit suppressed the action. Otherwise *runAt,
+ * if given, is set to the time the action may run (0 = right away).
+ */
+int
+sinkSubmit(int sink, UInt64 trace, UInt64 pressTime, UInt64 notBefore,
+           UInt64 budget, UInt32 action, UInt64 *runAt)
+{
+    if (!rateLimitTake(&sinkQueues[sink].limit, nanotime(), &notBefore))
+        return 0;
+    if (runAt)
+        *runAt = notBefore;
+
+    sinkEnqueue(sink, trace, pressTime, notBefore, budget, action);
+    return 1;
+}
+
+/*
+ * Stage an action under its deadline without the sink rate limit. Cue
+ * actions come this way: the limit is there for a bouncing remote, and
+ * must not fire half a cue.
+ */
+void
+sinkEnqueue(int sink, UInt64 trace, UInt64 pressTime, UInt64 notBefore,
+            UInt64 budget, UInt32 action)
+{
+    if (budget == 0)
+        budget = sinkQueues[sink].budget;
+    sinkStage(sink, trace, notBefore, budget ? pressTime + budget : 0,
+              action);
+}
+
+/*
+ * Release the key a button holds. The release is neither rate limited nor
+ * given a deadline: a key left down would be worse than a late key up.
+ */
+void
+keyRelease(int button, UInt64 trace)
+{
+    if (!heldKeys[button])
+        return;
+    sinkStage(SINK_ARROWS, trace, heldNotBefore[button], 0,
+              heldKeys[button] | KEY_UP_ONLY);
+    heldKeys[button] = 0;
+}
+
+void
+releaseKeys(void)
+{
+    UInt64 trace = 0;
+    int    b;
+
+    for (b = 0; b < NBUTTONS; b++)
+        if (heldKeys[b]) {
+            if (!trace)
+                trace = ++lastTraceID;
+            keyRelease(b, trace);
+        }
+}
+
+/*
+ * Move releases that found the arrows queue full into the slots that have
+ * freed up. Called with the queue lock held.
+ */
+void
+requeueReleases(sink_queue_t q)
+{
+    sink_task_t *task;
+    int          k;
+
+    for (k = 0; k < KEYCODES && lateReleaseCount &&
+                q->count < SINK_QUEUE_DEPTH; k++)
+        while (lateReleases[k] && q->count < SINK_QUEUE_DEPTH) {
+            task = &q->tasks[(q->head + q->count++) % SINK_QUEUE_DEPTH];
+            task->trace = lateTraces[k];
+            task->notBefore = 0;
+            task->deadline = 0;
+            task->action = k | KEY_UP_ONLY;
+            lateReleases[k]--;
+            lateReleaseCount--;
+        }
+}
+
+/*
+ * After releaseKeys() and a flush, wait for the arrows sink to post the
+ * releases and check that no key is left down. Presses still waiting for
+ * their time have not gone down yet, so they do not count.
+ */
+void
+checkKeysUp(void)
+{
+    sink_queue_t q = &sinkQueues[SINK_ARROWS];
+    UInt64       start = nanotime();
+    int          busy;
+
+    do {
+        pthread_mutex_lock(&q->lock);
+        busy = q->scheduled;
+        pthread_mutex_unlock(&q->lock);
+        if (busy)
+            usleep(1000);
+    } while (busy && nanotime() - start < KEY_UP_WAIT);
+
+    if (atomic_load(&keysDownTotal) != 0) {
+        stuckKeys++;
+        fprintf(stderr, "%d key(s) still down after releasing all keys.\n",
+                atomic_load(&keysDownTotal));
+    }
+}
+
+/*
+ * Move the staged tasks of a sink to its queue and schedule the queue if
+ * it was idle. Tasks that do not fit are dropped, except key releases.
+ */
+void
+sinkPublish(int sink)
+{
+    static int   nextWorker = 0;
+    sink_queue_t q = &sinkQueues[sink];
+    sink_task_t *task;
+    unsigned int i;
+    int          k, schedule = 0;
+
+    if (stagedCount[sink] == 0)
+        return;
+
+    pthread_mutex_lock(&q->lock);
+    for (i = 0; i < stagedCount[sink]; i++) {
+        task = &stagedTasks[sink][i];
+        if (q->count < SINK_QUEUE_DEPTH)
+            q->tasks[(q->head + q->count++) % SINK_QUEUE_DEPTH] = *task;
+        else if (sink == SINK_ARROWS && (task->action & KEY_UP_ONLY)) {
+            k = task->action & ~KEY_UP_ONLY;
+            lateReleases[k]++;
+            lateTraces[k] = task->trace;
+            lateReleaseCount++;
+            lateReleaseTotal++;
+        } else
+            q->dropped++;
+    }
+    if (q->count > q->maxDepth)
+        q->maxDepth = q->count;
+    if (q->count && !q->scheduled)
+        schedule = q->scheduled = 1;
+    pthread_mutex_unlock(&q->lock);
+    stagedCount[sink] = 0;
+
+    // only the run loop thread submits, so the round robin needs no lock
+    if (schedule) {
+        workerPush(&workers[nextWorker], q);
+        nextWorker = (nextWorker + 1) % workerCount;
+    }
+}
+
+void
+dispatchFlush(void)
+{
+    int k;
+
+    fflush(stdout);
+    for (k = 0; k < NSINKS; k++)
+        sinkPublish(k);
+    if (subscriberCount)
+        controlPublish();
+    else
+        publishedNext = historyNext;
+}
+
+void
+printStats(FILE *out)
+{
+    int i;
+
+    for (i = 0; i < NSINKS; i++) {
+        sink_queue_t q = &sinkQueues[i];
+
+        pthread_mutex_lock(&q->lock);
+        fprintf(out, "sink %-8s depth %u (max %u) executed %lu failed %lu "
+                "dropped %lu limited %lu missed %lu (%.1f%%)\n", q->name,
+                q->count, q->maxDepth, q->executed, q->failed, q->dropped,
+                atomic_load_explicit(&q->limit.limited, memory_order_relaxed),
+                q->missed, (q->executed + q->missed) ?
+                100.0 * q->missed / (q->executed + q->missed) : 0.0);
+        pthread_mutex_unlock(&q->lock);
+    }
+    for (i = 0; i < NBUTTONS; i++)
+        fprintf(out, "button %-6s limited %lu\n", buttonNames[i],
+                atomic_load_explicit(&buttonLimits[i].limited,
+                                     memory_order_relaxed));
+    for (i = 0; i < workerCount; i++) {
+        worker_t w = &workers[i];
+
+        pthread_mutex_lock(&w->lock);
+        fprintf(out, "worker %-2d ready %d executed %lu steals %lu\n",
+                i, w->count,
+                atomic_load_explicit(&w->executed, memory_order_relaxed),
+                atomic_load_explicit(&w->steals, memory_order_relaxed));
+        pthread_mutex_unlock(&w->lock);
+    }
+    pthread_mutex_lock(&errorLock);
+    for (i = 0; i < errorRecordCount; i++)
+        fprintf(out, "error %d count %lu\n",
+                errorRecords[i].code, errorRecords[i].count);
+    if (errorOverflow)
+        fprintf(out, "error (other codes) count %lu\n", errorOverflow);
+    pthread_mutex_unlock(&errorLock);
+    if (shadowEnabled) {
+        pthread_mutex_lock(&shadowLock);
+        fprintf(out, "shadow evaluated %lu divergent %lu", shadowEvaluated,
+                divergenceCount);
+        for (i = 0; i < NDIVERGENCES; i++)
+            fprintf(out, " %s %lu", divergenceNames[i], divergenceKinds[i]);
+        fprintf(out, "\n");
+        for (i = (divergenceCount > 8) ? 8 : (int)divergenceCount; i > 0; i--) {
+            divergence_t *d = &divergences[(divergenceCount - i) %
+                                           DIVERGENCE_RING];
+
+            fprintf(out, "  trace %llu %s %s: %s live %u shadow %u\n",
+                    d->trace, buttonNames[d->button], sinkNames[d->sink],
+                    divergenceNames[d->kind], (unsigned int)d->live,
+                    (unsigned int)d->shadow);
+        }
+        pthread_mutex_unlock(&shadowLock);
+    }
+    fprintf(out, "inject %s%s", injectNames[atomic_load(&injectPoint)],
+            injectAuto ? " (probed:" : "\n");
+    for (i = 0; injectAuto && i < NINJECTS; i++) {
+        if (atomic_load(&probeLatency[i]))
+            fprintf(out, " %s %llu ns", injectNames[i],
+                    atomic_load(&probeLatency[i]));
+        else
+            fprintf(out, " %s n/a", injectNames[i]);
+    }
+    if (injectAuto)
+        fprintf(out, ")\n");
+    if (holdPassthrough) {
+        int held = 0;
+
+        for (i = 0; i < NBUTTONS; i++)
+            held += (heldKeys[i] != 0);
+        fprintf(out, "hold keys held %d down %d late releases %lu stuck %lu "
+                "lircd inferred releases %lu\n", held,
+                atomic_load(&keysDownTotal), lateReleaseTotal, stuckKeys,
+                lircInferredReleases);
+    }
+    fprintf(out, "clock ir native (mach_absolute_time) error 0 us\n");
+    if (lircInputPath)
+        fprintf(out, "clock lircd arrival time\n");
+    if (websocketPort) {
+        websocket_client_t client;
+        double             sum = 0, worst = 0, drift = 0;
+        int                n = 0;
+
+        for (client = websocketList; client; client = client->next) {
+            if (!client->clock.anchored)
+                continue;
+            sum += client->clock.error;
+            drift += client->clock.drift;
+            if (client->clock.error > worst)
+                worst = client->clock.error;
+            n++;
+        }
+        fprintf(out, "clock websocket estimated clients %d error mean %.0f us "
+                "max %.0f us drift %.1f ppm\n", n, n ? sum / n / 1000 : 0.0,
+                worst / 1000, n ? drift / n * 1e6 : 0.0);
+    }
+    if (websocketPort) {
+        websocket_client_t client;
+        unsigned long      limited = websocketLimited;
+
+        // every client limits through its own bucket
+        for (client = websocketList; client; client = client->next)
+            limited += atomic_load_explicit(&client->limit.limited,
+                                            memory_order_relaxed);
+        fprintf(out, "websocket clients %lu accepted %lu refused %lu "
+                "messages %lu rejected %lu limited %lu\n", websocketClients,
+                websocketAccepted, websocketRefused, websocketMessages,
+                websocketRejected, limited);
+    }
+    if (lircPath)
+        fprintf(out, "lircd clients %lu lines %lu slow clients dropped %lu\n",
+                lircClientCount, lircLines, lircSlowClients);
+    if (lircInputPath)
+        fprintf(out, "lircd input %s connects %lu presses %lu repeats %lu "
+                "unknown %lu\n", lircInputSocket ? "connected" : "down",
+                lircInputConnects, lircInputPresses, lircInputRepeats,
+                lircInputUnknown);
+    if (cueCount)
+        fprintf(out, "cues %d standby %d fired %lu latency last %.1f us "
+                "mean %.1f us max %.1f us\n", cueCount, cueStandby + 1,
+                cuesFired, cueLatencyLast / 1e3,
+                cuesFired ? cueLatencyTotal / 1e3 / cuesFired : 0.0,
+                cueLatencyMax / 1e3);
+    fprintf(out, "session %s sessions %lu", sessionActive ? "active" : "idle",
+            sessionCount);
+    for (i = 0; i < 2; i++)
+        fprintf(out, " after pause %s %lu mean %.1f us max %.1f us",
+                i ? "in session" : "idle", pauseCount[i],
+                pauseCount[i] ? pauseLatencyTotal[i] / 1e3 / pauseCount[i]
+                              : 0.0, pauseLatencyMax[i] / 1e3);
+    fprintf(out, "\n");
+    if (appCount)
+        fprintf(out, "focus %s keymap %s changes %lu via %s "
+                "notifications %lu polled %lu\n",
+                activeAppID[0] ? activeAppID : "-",
+                (activeApp >= 0) ? appIDs[activeApp] : "default",
+                focusChanges, focusPollTimer ? "poll" : "notifications",
+                focusNotifications, focusPolled);
+    {
+        pool_t *pools[] = { &controlPool, &websocketPool, &lircPool };
+
+        for (i = 0; i < (int)(sizeof(pools) / sizeof(pools[0])); i++)
+            fprintf(out, "pool %-9s in use %lu high water %lu capacity %lu "
+                    "limit %lu refused %lu\n", pools[i]->name,
+                    pools[i]->inUse, pools[i]->highWater, pools[i]->capacity,
+                    pools[i]->limit, pools[i]->refused);
+    }
+    fprintf(out, "receiver %s sleeps %lu resume-to-ready %.1f ms "
+            "reattach retries %lu\n",
+            !receiverUsed ? "unused" : hidQueue ? "attached" : "detached",
+            sleepCount, lastResumeReady / 1e6, reattachFailures);
+    fprintf(out, "traces %llu unchanged reports skipped %lu\n",
+            lastTraceID, unchangedReports);
+    fprintf(out, "history next %llu subscribers %lu lines %lu gaps %lu\n",
+            historyNext, subscriberCount, fanoutLines, historyGaps);
+    fprintf(out, "pending tasks %d (max %d)\n", pendingCount, pendingMax);
+    fprintf(out, "batches %lu events %lu (mean %.1f, largest %d)\n",
+            eventBatches, batchedEvents,
+            eventBatches ? (double)batchedEvents / eventBatches : 0.0,
+            largestBatch);
+    fflush(out);
+}
+
+void
+StatsTimerCallback(CFRunLoopTimerRef timer, void *info)
+{
+    printStats(stderr);
+}
+
+void
+subscriberSet(subscriber_set_t set, int slot, int on)
+{
+    if (on)
+        set[slot / 64] |= 1ULL << (slot % 64);
+    else
+        set[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+void
+controlClose(control_client_t client)
+{
+    int i;
+
+    if (client->subscribed) {
+        for (i = 0; i < NSOURCES; i++)
+            subscriberSet(sourceSubscribers[i], client->slot, 0);
+        for (i = 0; i <= NBUTTONS; i++)
+            subscriberSet(buttonSubscribers[i], client->slot, 0);
+        for (i = 0; i < 2; i++)
+            subscriberSet(edgeSubscribers[i], client->slot, 0);
+        subscriberSet(liveSubscribers, client->slot, 0);
+        subscriberSet(laggingSubscribers, client->slot, 0);
+        subscriberSlots[client->slot] = NULL;
+        subscriberCount--;
+    }
+    CFRunLoopRemoveSource(CFRunLoopGetCurrent(), client->source,
+                          kCFRunLoopDefaultMode);
+    CFSocketInvalidate(client->socket);
+    CFRelease(client->source);
+    CFRelease(client->socket);
+    poolPut(&controlPool, client);
+}
+
+int
+formatEvent(char *line, UInt64 seq, history_event_t *e)
+{
+    return snprintf(line, EVENT_LINE, "event %llu %llu %llu %s %s %s\n",
+                    seq, e->trace, e->timestamp, sourceNames[e->source],
+                    (e->button == BUTTON_NONE) ? "-" : buttonNames[e->button],
+                    e->value ? "pressed" : "depressed");
+}
+
+/*
+ * Write as much of a subscriber's output as its socket takes. Returns -1
+ * if the client is gone.
+ */
+int
+controlFlush(control_client_t client)
+{
+    ssize_t n;
+
+    if (!client->pending)
+        return 0;
+    n = write(CFSocketGetNative(client->socket), client->out, client->pending);
+    if (n < 0 && errno != EAGAIN)
+        return -1;
+    if (n > 0) {
+        memmove(client->out, client->out + n, client->pending - n);
+        client->pending -= n;
+    }
+    if (client->pending)
+        CFSocketEnableCallBacks(client->socket, kCFSocketWriteCallBack);
+    return 0;
+}
+
+/*
+ * Feed a lagging subscriber from the history ring, starting at its cursor,
+ * until it has caught up and rejoins the live set, or its socket is full.
+ * Returns -1 if the client is gone.
+ */
+int
+controlSend(control_client_t client)
+{
+    history_event_t *e;
+    UInt64           oldest;
+    size_t           before;
+
+    for (;;) {
+        oldest = (historyNext > HISTORY_SIZE) ? historyNext - HISTORY_SIZE : 1;
+        while (client->cursor < historyNext &&
+               client->pending + EVENT_LINE <= CONTROL_OUT) {
+            if (client->cursor < oldest) {
+                client->pending += snprintf(client->out + client->pending,
+                                            EVENT_LINE, "gap %llu %llu\n",
+                                            client->cursor, oldest - 1);
+                client->cursor = oldest;
+                historyGaps++;
+                continue;
+            }
+            e = &history[client->cursor % HISTORY_SIZE];
+            if ((client->sources >> e->source & 1) &&
+                (client->buttons >> (e->button + 1) & 1) &&
+                (client->edges >> (e->value != 0) & 1))
+                client->pending += formatEvent(client->out + client->pending,
+                                               client->cursor, e);
+            client->cursor++;
+        }
+        if (client->cursor == historyNext) {
+            subscriberSet(laggingSubscribers, client->slot, 0);
+            subscriberSet(liveSubscribers, client->slot, 1);
+            return controlFlush(client);
+        }
+        before = client->pending;
+        if (controlFlush(client) < 0)
+            return -1;
+        if (client->pending == before)
+            return 0;               // the write callback resumes
+    }
+}
+
+/*
+ * Fan the events dispatched since the last call out to the live
+ * subscribers they match, then write to every subscriber that got output
+ * and let lagging subscribers catch up.
+ */
+void
+controlPublish(void)
+{
+    subscriber_set_t  touched;
+    history_event_t  *e;
+    control_client_t  client;
+    char              line[EVENT_LINE];
+    UInt64            seq, oldest, bits;
+    int               w, slot, length;
+
+    memset(touched, 0, sizeof(touched));
+    oldest = (historyNext > HISTORY_SIZE) ? historyNext - HISTORY_SIZE : 1;
+    for (seq = (publishedNext > oldest) ? publishedNext : oldest;
+         seq < historyNext; seq++) {
+        e = &history[seq % HISTORY_SIZE];
+        length = -1;
+        for (w = 0; w < SUBSCRIBER_WORDS; w++) {
+            bits = liveSubscribers[w] & sourceSubscribers[e->source][w] &
+                   buttonSubscribers[e->button + 1][w] &
+                   edgeSubscribers[e->value != 0][w];
+            for (; bits; bits &= bits - 1) {
+                slot = w * 64 + __builtin_ctzll(bits);
+                client = subscriberSlots[slot];
+                if (length < 0)
+                    length = formatEvent(line, seq, e);
+                if (client->pending + length > CONTROL_OUT) {
+                    // backed up: replay from the ring from here on
+                    client->cursor = seq;
+                    subscriberSet(liveSubscribers, slot, 0);
+                    subscriberSet(laggingSubscribers, slot, 1);
+                    continue;
+                }
+                memcpy(client->out + client->pending, line, length);
+                client->pending += length;
+                touched[w] |= 1ULL << (slot % 64);
+                fanoutLines++;
+            }
+        }
+    }
+    publishedNext = historyNext;
+
+    for (w = 0; w < SUBSCRIBER_WORDS; w++)
+        for (bits = touched[w] | laggingSubscribers[w]; bits;
+             bits &= bits - 1) {
+            client = subscriberSlots[w * 64 + __builtin_ctzll(bits)];
+            if ((laggingSubscribers[w] >> (client->slot % 64) & 1) ?
+                controlSend(client) < 0 : controlFlush(client) < 0)
+                controlClose(client);
+        }
+}
+
+/*
+ * Parse a comma separated list of names into a bit mask, bit i + shift for
+ * names[i]. Returns 0 for an unknown name.
+ */
+UInt32
+parseNameSet(char *list, const char **names, int count, int shift)
+{
+    UInt32 mask = 0;
+    char  *comma;
+    int    i;
+
+    for (; list; list = comma) {
+        if ((comma = strchr(list, ',')) != NULL)
+            *comma++ = '\0';
+        for (i = 0; i < count; i++)
+            if (strcmp(list, names[i]) == 0)
+                break;
+        if (i == count)
+            return 0;
+        mask |= 1U << (i + shift);
+    }
+    return mask;
+}
+
+/*
+ * Returns -1 if the subscription was refused; the client stays a command
+ * connection then. The arguments are tokenized in a copy, so the caller's
+ * line buffer is left intact.
+ */
+int
+controlSubscribe(control_client_t client, const char *args)
+{
+    static const char *edgeNames[2] = { "depressed", "pressed" };
+    const char        *error = NULL;
+    char               copy[CONTROL_LINE], *token;
+    UInt64             from = historyNext;
+    int                fd = CFSocketGetNative(client->socket);
+    int                i, slot;
+
+    snprintf(copy, sizeof(copy), "%s", args);
+    client->sources = (1U << NSOURCES) - 1;
+    client->buttons = (1U << (NBUTTONS + 1)) - 1;
+    client->edges = 3;
+    for (token = strtok(copy, " \t"); token && !error;
+         token = strtok(NULL, " \t")) {
+        if (strcmp(token, "from") == 0) {
+            if ((token = strtok(NULL, " \t")) == NULL)
+                error = "missing sequence";
+            else
+                from = strtoull(token, NULL, 10);
+        } else if (strncmp(token, "source=", 7) == 0) {
+            if (!(client->sources = parseNameSet(token + 7, sourceNames,
+                                                 NSOURCES, 0)))
+                error = "unknown source";
+        } else if (strncmp(token, "button=", 7) == 0) {
+            if (!(client->buttons = parseNameSet(token + 7, buttonNames,
+                                                 NBUTTONS, 1)))
+                error = "unknown button";
+        } else if (strncmp(token, "edge=", 5) == 0) {
+            if (!(client->edges = parseNameSet(token + 5, edgeNames, 2, 0)))
+                error = "unknown edge";
+        } else
+            error = "unknown filter";
+    }
+    for (slot = 0; !error && slot < MAX_SUBSCRIBERS; slot++)
+        if (!subscriberSlots[slot])
+            break;
+    if (!error && slot == MAX_SUBSCRIBERS)
+        error = "too many subscribers";
+    if (error) {
+        dprintf(fd, "error %s\n", error);
+        return -1;
+    }
+
+    if (from < 1)
+        from = 1;
+    if (from > historyNext)
+        from = historyNext;
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    client->subscribed = 1;
+    client->slot = slot;
+    client->cursor = from;
+    subscriberSlots[slot] = client;
+    for (i = 0; i < NSOURCES; i++)
+        subscriberSet(sourceSubscribers[i], slot, client->sources >> i & 1);
+    for (i = 0; i <= NBUTTONS; i++)
+        subscriberSet(buttonSubscribers[i], slot, client->buttons >> i & 1);
+    for (i = 0; i < 2; i++)
+        subscriberSet(edgeSubscribers[i], slot, client->edges >> i & 1);
+    subscriberSet(laggingSubscribers, slot, 1);
+    subscriberCount++;
+    if (controlSend(client) < 0)
+        controlClose(client);
+    return 0;
+}
+
+void
+controlCommand(control_client_t client, const char *command)
+{
+    FILE *out;
+    int   fd, n;
+
+    if ((fd = dup(CFSocketGetNative(client->socket))) < 0 ||
+        (out = fdopen(fd, "w")) == NULL) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    if (strcmp(command, "stats") == 0)
+        printStats(out);
+    else if (cueCount && (strcmp(command, "go") == 0 ||
+                          strcmp(command, "back") == 0 ||
+                          strncmp(command, "cue ", 4) == 0)) {
+        if (strcmp(command, "go") == 0) {
+            cueGo(++lastTraceID, nanotime(), 0);
+            dispatchFlush();
+        } else if (strcmp(command, "back") == 0) {
+            if (cueStandby > 0)
+                cueStandby--;
+        } else if ((n = atoi(command + 4)) >= 1 && n <= cueCount)
+            cueStandby = n - 1;
+        else {
+            fprintf(out, "error no cue %s, the list has %d\n", command + 4,
+                    cueCount);
+            fclose(out);
+            return;
+        }
+        if (cueStandby < cueCount)
+            fprintf(out, "standby %d %s\n", cueStandby + 1,
+                    cues[cueStandby].name);
+        else
+            fprintf(out, "standby end\n");
+    }
+    else if (strcmp(command, "probe") == 0) {
+        if (startProbe())
+            fprintf(out, "probe started, see the stats for the results\n");
+        else
+            fprintf(out, "error probe already running\n");
+    } else
+        fprintf(out, "error unknown command \"%s\"\n", command);
+
+    fclose(out);
+}
+
+void
+ControlReadCallback(CFSocketRef s, CFSocketCallBackType type,
+                    CFDataRef address, const void *data, void *info)
+{
+    control_client_t client = (control_client_t)info;
+    char            *newline;
+    ssize_t          n;
+
+    if (type == kCFSocketWriteCallBack) {
+        if (client->subscribed &&
+            ((laggingSubscribers[client->slot / 64] >> (client->slot % 64) & 1)
+             ? controlSend(client) : controlFlush(client)) < 0)
+            controlClose(client);
+        return;
+    }
+
+    n = read(CFSocketGetNative(s), client->line + client->length,
+             CONTROL_LINE - 1 - client->length);
+    if (n == 0 || (n < 0 && errno != EAGAIN)) {
+        controlClose(client);
+        return;
+    }
+    if (n < 0 || client->subscribed)
+        return;
+    client->length += n;
+    client->line[client->length] = '\0';
+
+    while ((newline = strchr(client->line, '\n')) != NULL) {
+        *newline = '\0';
+        if (newline > client->line && newline[-1] == '\r')
+            newline[-1] = '\0';
+        if (strncmp(client->line, "subscribe", 9) == 0 &&
+            (client->line[9] == '\0' || client->line[9] == ' ')) {
+            if (controlSubscribe(client, client->line + 9) == 0)
+                return;
+        } else
+            controlCommand(client, client->line);
+        client->length -= newline + 1 - client->line;
+        memmove(client->line, newline + 1, client->length + 1);
+    }
+    // overlong lines are discarded
+    if (client->length == CONTROL_LINE - 1)
+        client->length = 0;
+}
+
+void
+ControlAcceptCallback(CFSocketRef s, CFSocketCallBackType type,
+                      CFDataRef address, const void *data, void *info)
+{
+    CFSocketContext  context = { 0, NULL, NULL, NULL, NULL };
+    control_client_t client;
+    int              fd = *(const CFSocketNativeHandle *)data;
+    int              on = 1;
+
+    if ((client = poolGet(&controlPool)) == NULL) {
+        close(fd);
+        return;
+    }
+    (void)setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+
+    context.info = client;
+    client->socket = CFSocketCreateWithNative(NULL, fd,
+                         kCFSocketReadCallBack | kCFSocketWriteCallBack,
+                         ControlReadCallback, &context);
+    client->source = CFSocketCreateRunLoopSource(NULL, client->socket, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), client->source,
+                       kCFRunLoopDefaultMode);
+}
+
+void
+startControl(void)
+{
+    struct sockaddr_un addr;
+    CFSocketRef        listener;
+    CFRunLoopSourceRef source;
+    int                fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    print_errmsg_if_err(strlen(controlPath) >= sizeof(addr.sun_path),
+                        "Control socket path too long");
+    strcpy(addr.sun_path, controlPath);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    print_errmsg_if_err(fd < 0, "Failed to create control socket");
+    (void)unlink(controlPath);
+    print_errmsg_if_err(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+                        listen(fd, 8) < 0, "Failed to bind control socket");
+
+    listener = CFSocketCreateWithNative(NULL, fd, kCFSocketAcceptCallBack,
+                                        ControlAcceptCallback, NULL);
+    source = CFSocketCreateRunLoopSource(NULL, listener, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+}
+
+/*
+ * Map a remote timestamp (nanoseconds) into the local domain, given the
+ * local time it arrived at.
+ */
+UInt64
+clockAlign(clock_domain_t *clock, double remote, UInt64 arrival)
+{
+    double offset = (double)arrival - remote, predicted;
+
+    if (clock->windowCount == 0 || offset < clock->windowMin) {
+        clock->windowMin = offset;
+        clock->windowRemote = remote;
+    }
+    if (++clock->windowCount == CLOCK_WINDOW) {
+        if (clock->anchored) {
+            predicted = clock->anchorOffset +
+                        clock->drift * (clock->windowRemote -
+                                        clock->anchorRemote);
+            clock->error += (fabs(clock->windowMin - predicted) -
+                             clock->error) / 4;
+            if (clock->windowRemote > clock->anchorRemote)
+                clock->drift += ((clock->windowMin - clock->anchorOffset) /
+                                 (clock->windowRemote - clock->anchorRemote) -
+                                 clock->drift) / 4;
+        }
+        clock->anchorOffset = clock->windowMin;
+        clock->anchorRemote = clock->windowRemote;
+        clock->anchored = 1;
+        clock->windowCount = 0;
+    }
+
+    if (clock->anchored)
+        predicted = clock->anchorOffset +
+                    clock->drift * (remote - clock->anchorRemote);
+    else
+        predicted = clock->windowMin;
+    // an event never happened after it arrived
+    if (predicted > offset)
+        predicted = offset;
+
+    return (UInt64)(remote + predicted);
+}
+
+void
+sha1(const void *data, size_t length, unsigned char digest[SHA1_LENGTH])
+{
+    const unsigned char *in = data;
+    unsigned char        block[64];
+    UInt32               h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe,
+                                  0x10325476, 0xc3d2e1f0 };
+    UInt32               w[80], a, b, c, d, e, f, k, t;
+    UInt64               bits = (UInt64)length * 8;
+    size_t               done, n;
+    int                  i, last = 0;
+
+    // the padding adds 0x80, zeros and the bit length, in one or two blocks
+    for (done = 0; !last; done += 64) {
+        n = (length > done) ? length - done : 0;
+        if (n >= 64)
+            memcpy(block, in + done, 64);
+        else {
+            memset(block, 0, 64);
+            if (n > 0)
+                memcpy(block, in + done, n);
+            if (done <= length)
+                block[n] = 0x80;
+            if (n < 56) {
+                for (i = 0; i < 8; i++)
+                    block[63 - i] = (unsigned char)(bits >> (8 * i));
+                last = 1;
+            }
+        }
+
+        for (i = 0; i < 16; i++)
+            w[i] = (UInt32)block[4 * i] << 24 | block[4 * i + 1] << 16 |
+                   block[4 * i + 2] << 8 | block[4 * i + 3];
+        for (; i < 80; i++) {
+            t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = (t << 1) | (t >> 31);
+        }
+        a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+        for (i = 0; i < 80; i++) {
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for (i = 0; i < SHA1_LENGTH; i++)
+        digest[i] = (unsigned char)(h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+void
+base64Encode(const unsigned char *in, size_t length, char *out)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    UInt32 bits;
+    size_t i;
+
+    for (i = 0; i + 2 < length; i += 3) {
+        bits = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        *out++ = alphabet[(bits >> 18) & 0x3f];
+        *out++ = alphabet[(bits >> 12) & 0x3f];
+        *out++ = alphabet[(bits >> 6) & 0x3f];
+        *out++ = alphabet[bits & 0x3f];
+    }
+    if (i < length) {
+        bits = in[i] << 16;
+        if (i + 1 < length)
+            bits |= in[i + 1] << 8;
+        *out++ = alphabet[(bits >> 18) & 0x3f];
+        *out++ = alphabet[(bits >> 12) & 0x3f];
+        *out++ = (i + 1 < length) ? alphabet[(bits >> 6) & 0x3f] : '=';
+        *out++ = '=';
+    }
+    *out = '\0';
+}
+
+void
+websocketClose(websocket_client_t client)
+{
+    websocket_client_t *link;
+    int                 button;
+
+    // a client that goes away releases what it holds
+    for (button = 0; button < NBUTTONS; button++)
+        if (client->held & (1U << button))
+            dispatchEvent(SOURCE_WEBSOCKET, button, button, 0, nanotime(), 0);
+
+    for (link = &websocketList; *link; link = &(*link)->next)
+        if (*link == client) {
+            *link = client->next;
+            break;
+        }
+    CFRunLoopRemoveSource(CFRunLoopGetCurrent(), client->source,
+                          kCFRunLoopDefaultMode);
+    CFSocketInvalidate(client->socket);
+    CFRelease(client->source);
+    CFRelease(client->socket);
+    websocketLimited += atomic_load_explicit(&client->limit.limited,
+                                             memory_order_relaxed);
+    poolPut(&websocketPool, client);
+    websocketClients--;
+}
+
+/*
+ * Find the header NAME in the request headers before END. Returns its
+ * value with surrounding blanks stripped, or NULL if it is missing.
+ */
+const char *
+httpHeader(const char *request, const char *end, const char *name,
+           size_t *length)
+{
+    const char *line, *value;
+    size_t      nameLength = strlen(name);
+
+    for (line = strstr(request, "\r\n"); line && line < end;
+         line = strstr(line + 2, "\r\n"))
+        if (strncasecmp(line + 2, name, nameLength) == 0 &&
+            line[2 + nameLength] == ':') {
+            value = line + 3 + nameLength;
+            value += strspn(value, " \t");
+            *length = strcspn(value, "\r\n");
+            while (*length && strchr(" \t", value[*length - 1]))
+                (*length)--;
+            return value;
+        }
+    return NULL;
+}
+
+/*
+ * Answer a refused upgrade with STATUS and drop the client.
+ */
+int
+websocketRefuse(websocket_client_t client, const char *status)
+{
+    char reply[128];
+    int  n;
+
+    n = snprintf(reply, sizeof(reply), "HTTP/1.1 %s\r\n"
+                 "Sec-WebSocket-Version: 13\r\n"
+                 "Content-Length: 0\r\n\r\n", status);
+    (void)write(CFSocketGetNative(client->socket), reply, n);
+    websocketRefused++;
+    return -1;
+}
+
+/*
+ * Returns 1 once the upgrade request has been answered, 0 while it is
+ * incomplete and -1 if the client has to be dropped.
+ */
+int
+websocketHandshake(websocket_client_t client)
+{
+    unsigned char digest[SHA1_LENGTH];
+    char          accept[32], keyGUID[128], reply[256];
+    char         *request = (char *)client->buffer;
+    char         *end;
+    const char   *key, *value;
+    size_t        keyLength, length;
+    int           i, n;
+
+    client->buffer[client->length] = '\0';
+    if ((end = strstr(request, "\r\n\r\n")) == NULL)
+        return (client->length == WEBSOCKET_BUFFER) ? -1 : 0;
+    end += 2;                           // keep the last header's CRLF
+
+    length = strcspn(request, "\r\n");
+    if (length < 14 || strncmp(request, "GET ", 4) != 0 ||
+        strncmp(request + length - 9, " HTTP/1.1", 9) != 0 ||
+        (value = httpHeader(request, end, "Upgrade", &length)) == NULL ||
+        length != 9 || strncasecmp(value, "websocket", 9) != 0 ||
+        (key = httpHeader(request, end, "Sec-WebSocket-Key", &keyLength)) ==
+        NULL || keyLength == 0 || keyLength > 64)
+        return websocketRefuse(client, "400 Bad Request");
+    if ((value = httpHeader(request, end, "Sec-WebSocket-Version",
+                            &length)) == NULL ||
+        length != 2 || strncmp(value, "13", 2) != 0)
+        return websocketRefuse(client, "426 Upgrade Required");
+    if ((value = httpHeader(request, end, "Origin", &length)) != NULL) {
+        for (i = 0; i < websocketOriginCount; i++)
+            if (strlen(websocketOrigins[i]) == length &&
+                strncasecmp(websocketOrigins[i], value, length) == 0)
+                break;
+        if (i == websocketOriginCount)
+            return websocketRefuse(client, "403 Forbidden");
+    }
+
+    snprintf(keyGUID, sizeof(keyGUID), "%.*s%s", (int)keyLength, key,
+             WEBSOCKET_GUID);
+    sha1(keyGUID, strlen(keyGUID), digest);
+    base64Encode(digest, sizeof(digest), accept);
+    n = snprintf(reply, sizeof(reply),
+                 "HTTP/1.1 101 Switching Protocols\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    if (write(CFSocketGetNative(client->socket), reply, n) != n)
+        return -1;
+
+    end += 2;
+    client->length -= end - request;
+    memmove(client->buffer, end, client->length);
+    client->open = 1;
+
+    return 1;
+}
+
+void
+websocketMessage(websocket_client_t client, const char *text, size_t length)
+{
+    char   message[64];
+    char  *name, *token, *state = NULL, *end;
+    UInt64 now = nanotime(), notBefore = 0, timestamp;
+    double remote = -1;
+    int    button;
+
+    websocketMessages++;
+    if (length >= sizeof(message)) {
+        websocketRejected++;
+        return;
+    }
+    memcpy(message, text, length);
+    message[length] = '\0';
+
+    name = strtok(message, " \t\r\n");
+    while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+        if (strncmp(token, "t=", 2) == 0) {
+            remote = strtod(token + 2, &end) * 1e6;
+            if (*end != '\0' || remote < 0)
+                name = NULL;
+        } else if (!state)
+            state = token;
+        else
+            name = NULL;
+    }
+    for (button = 0; name && button < NBUTTONS; button++)
+        if (strcmp(name, buttonNames[button]) == 0)
+            break;
+    if (!name || button == NBUTTONS ||
+        (state && strcmp(state, "pressed") && strcmp(state, "depressed"))) {
+        websocketRejected++;
+        return;
+    }
+
+    timestamp = (remote >= 0) ? clockAlign(&client->clock, remote, now) : now;
+    // only a release of a held button passes, so releases never outnumber
+    // the presses the client's limit let through
+    if (state && strcmp(state, "depressed") == 0) {
+        if (!(client->held & (1U << button))) {
+            websocketRejected++;
+            return;
+        }
+        client->held &= ~(1U << button);
+        dispatchEvent(SOURCE_WEBSOCKET, button, button, 0, timestamp, 0);
+        return;
+    }
+    if (!rateLimitTake(&client->limit, now, &notBefore))
+        return;
+    dispatchEvent(SOURCE_WEBSOCKET, button, button, 1, timestamp, notBefore);
+    if (!state)
+        dispatchEvent(SOURCE_WEBSOCKET, button, button, 0, timestamp, 0);
+    else
+        client->held |= 1U << button;
+}
+
+/*
+ * Send a close frame with STATUS; the client has to be dropped.
+ */
+int
+websocketFail(int fd, UInt16 status)
+{
+    unsigned char frame[4] = { 0x88, 2, status >> 8, status & 0xff };
+
+    (void)write(fd, frame, sizeof(frame));
+    return -1;
+}
+
+/*
+ * Decode the complete frames in the client buffer. Returns -1 if the
+ * client has to be dropped.
+ */
+int
+websocketFrames(websocket_client_t client)
+{
+    unsigned char *frame = client->buffer, *mask, *payload;
+    unsigned char  pong[2 + 125];
+    size_t         available = client->length, header, length, i;
+    int            fd = CFSocketGetNative(client->socket);
+    int            opcode, fin;
+
+    while (available >= 2) {
+        // client frames are always masked; messages never need 64-bit sizes
+        if (!(frame[1] & 0x80) || (frame[1] & 0x7f) == 127)
+            return -1;
+        length = frame[1] & 0x7f;
+        header = 2;
+        if (length == 126) {
+            if (available < 4)
+                break;
+            length = (frame[2] << 8) | frame[3];
+            header = 4;
+        }
+        if (header + 4 + length > WEBSOCKET_BUFFER)
+            return websocketFail(fd, 1009);
+        if (available < header + 4 + length)
+            break;
+
+        mask = frame + header;
+        payload = mask + 4;
+        for (i = 0; i < length; i++)
+            payload[i] ^= mask[i % 4];
+
+        opcode = frame[0] & 0x0f;
+        fin = frame[0] & 0x80;
+        // control frames may come between fragments but are never split
+        if (opcode >= 0x8 && (!fin || length > 125))
+            return websocketFail(fd, 1002);
+        switch (opcode) {
+        case 0x1:                       // text
+        case 0x2:                       // binary, ignored
+            if (client->fragments)
+                return websocketFail(fd, 1002);
+            if (opcode == 0x1 && fin) {
+                websocketMessage(client, (const char *)payload, length);
+                break;
+            }
+            client->fragments = opcode;
+            client->messageLength = 0;
+            // fall through
+        case 0x0:                       // continuation
+            if (!client->fragments)
+                return websocketFail(fd, 1002);
+            if (client->fragments == 0x1) {
+                if (client->messageLength + length > WEBSOCKET_MESSAGE)
+                    return websocketFail(fd, 1009);
+                memcpy(client->message + client->messageLength, payload,
+                       length);
+                client->messageLength += length;
+            }
+            if (fin) {
+                if (client->fragments == 0x1)
+                    websocketMessage(client, client->message,
+                                     client->messageLength);
+                client->fragments = 0;
+            }
+            break;
+        case 0x8:                       // close
+            (void)write(fd, "\x88\x00", 2);
+            return -1;
+        case 0x9:                       // ping
+            pong[0] = 0x8a;
+            pong[1] = length;
+            memcpy(pong + 2, payload, length);
+            if (write(fd, pong, 2 + length) != (ssize_t)(2 + length))
+                return -1;
+            break;
+        case 0xa:                       // pong
+            break;
+        default:
+            return websocketFail(fd, 1002);
+        }
+
+        frame += header + 4 + length;
+        available -= header + 4 + length;
+    }
+
+    memmove(client->buffer, frame, available);
+    client->length = available;
+
+    return 0;
+}
+
+void
+WebSocketReadCallback(CFSocketRef s, CFSocketCallBackType type,
+                      CFDataRef address, const void *data, void *info)
+{
+    websocket_client_t client = (websocket_client_t)info;
+    ssize_t            n;
+
+    n = read(CFSocketGetNative(s), client->buffer + client->length,
+             WEBSOCKET_BUFFER - client->length);
+    if (n < 0 && errno == EAGAIN)
+        return;
+    if (n <= 0) {
+        websocketClose(client);
+        return;
+    }
+    client->length += n;
+
+    if ((!client->open && websocketHandshake(client) < 0) ||
+        (client->open && websocketFrames(client) < 0))
+        websocketClose(client);
+}
+
+void
+WebSocketAcceptCallback(CFSocketRef s, CFSocketCallBackType type,
+                        CFDataRef address, const void *data, void *info)
+{
+    CFSocketContext    context = { 0, NULL, NULL, NULL, NULL };
+    websocket_client_t client;
+    int                fd = *(const CFSocketNativeHandle *)data;
+    int                on = 1;
+
+    if ((client = poolGet(&websocketPool)) == NULL) {
+        close(fd);
+        return;
+    }
+    (void)setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    client->limit.interval = websocketLimit.interval;
+    client->limit.tolerance = websocketLimit.tolerance;
+    client->next = websocketList;
+    websocketList = client;
+
+    context.info = client;
+    client->socket = CFSocketCreateWithNative(NULL, fd, kCFSocketReadCallBack,
+                                              WebSocketReadCallback, &context);
+    client->source = CFSocketCreateRunLoopSource(NULL, client->socket, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), client->source,
+                       kCFRunLoopDefaultMode);
+    websocketClients++;
+    websocketAccepted++;
+}
+
+void
+startWebSocket(void)
+{
+    struct sockaddr_in addr;
+    CFSocketRef        listener;
+    CFRunLoopSourceRef source;
+    int                fd, on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(websocketPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    print_errmsg_if_err(fd < 0, "Failed to create WebSocket socket");
+    (void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    print_errmsg_if_err(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+                        listen(fd, 64) < 0, "Failed to bind WebSocket socket");
+
+    if (websocketLimit.interval == 0) {
+        websocketLimit.interval = 1000000000ULL / WEBSOCKET_RATE;
+        websocketLimit.tolerance = (WEBSOCKET_BURST - 1) *
+                                   websocketLimit.interval;
+    }
+
+    listener = CFSocketCreateWithNative(NULL, fd, kCFSocketAcceptCallBack,
+                                        WebSocketAcceptCallback, NULL);
+    source = CFSocketCreateRunLoopSource(NULL, listener, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+}
+
+void
+lircClose(lirc_client_t client)
+{
+    lirc_client_t *link;
+
+    for (link = &lircClients; *link; link = &(*link)->next)
+        if (*link == client) {
+            *link = client->next;
+            break;
+        }
+    CFRunLoopRemoveSource(CFRunLoopGetCurrent(), client->source,
+                          kCFRunLoopDefaultMode);
+    CFSocketInvalidate(client->socket);
+    CFRelease(client->source);
+    CFRelease(client->socket);
+    poolPut(&lircPool, client);
+    lircClientCount--;
+}
+
+/*
+ * Write the client's backlog followed by line (which may be empty) in a
+ * single writev(), and keep whatever the socket did not take. Returns -1
+ * if the client is gone or too far behind.
+ */
+int
+lircWrite(lirc_client_t client, const char *line, size_t length)
+{
+    struct iovec iov[2];
+    ssize_t      n;
+    size_t       written;
+
+    iov[0].iov_base = client->buffer;
+    iov[0].iov_len = client->pending;
+    iov[1].iov_base = (void *)line;
+    iov[1].iov_len = length;
+    n = writev(CFSocketGetNative(client->socket), iov, 2);
+    if (n < 0 && errno != EAGAIN)
+        return -1;
+    written = (n < 0) ? 0 : (size_t)n;
+
+    if (written < client->pending) {
+        memmove(client->buffer, client->buffer + written,
+                client->pending - written);
+        client->pending -= written;
+        written = 0;
+    } else {
+        written -= client->pending;
+        client->pending = 0;
+    }
+    if (written < length) {
+        if (client->pending + length - written > LIRC_CLIENT_BUFFER) {
+            lircSlowClients++;
+            return -1;
+        }
+        memcpy(client->buffer + client->pending, line + written,
+               length - written);
+        client->pending += length - written;
+    }
+
+    if (client->pending)
+        CFSocketEnableCallBacks(client->socket, kCFSocketWriteCallBack);
+
+    return 0;
+}
+
+void
+lircBroadcast(int button, int repeat)
+{
+    lirc_client_t client, next;
+    char          line[128];
+    int           length;
+
+    if (!lircClients)
+        return;
+
+    length = snprintf(line, sizeof(line), "%016llx %02x %s %s\n",
+                      ((UInt64)kHIDPage_GenericDesktop << 16) |
+                      lircButtonCodes[button], repeat & 0xff,
+                      lircButtonNames[button], LIRC_REMOTE);
+    lircLines++;
+
+    for (client = lircClients; client; client = next) {
+        next = client->next;
+        if (lircWrite(client, line, length) < 0)
+            lircClose(client);
+    }
+}
+
+void
+LircCallback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address,
+             const void *data, void *info)
+{
+    lirc_client_t client = (lirc_client_t)info;
+    char          discard[256];
+    ssize_t       n;
+
+    if (type == kCFSocketWriteCallBack) {
+        if (lircWrite(client, "", 0) < 0)
+            lircClose(client);
+        return;
+    }
+
+    // commands from clients are not supported, only end of file matters
+    n = read(CFSocketGetNative(s), discard, sizeof(discard));
+    if (n == 0 || (n < 0 && errno != EAGAIN))
+        lircClose(client);
+}
+
+void
+LircAcceptCallback(CFSocketRef s, CFSocketCallBackType type,
+                   CFDataRef address, const void *data, void *info)
+{
+    CFSocketContext context = { 0, NULL, NULL, NULL, NULL };
+    lirc_client_t   client;
+    int             fd = *(const CFSocketNativeHandle *)data;
+    int             on = 1;
+
+    if ((client = poolGet(&lircPool)) == NULL) {
+        close(fd);
+        return;
+    }
+    (void)setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    context.info = client;
+    client->socket = CFSocketCreateWithNative(NULL, fd,
+                         kCFSocketReadCallBack | kCFSocketWriteCallBack,
+                         LircCallback, &context);
+    client->source = CFSocketCreateRunLoopSource(NULL, client->socket, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), client->source,
+                       kCFRunLoopDefaultMode);
+    client->next = lircClients;
+    lircClients = client;
+    lircClientCount++;
+}
+
+void
+startLirc(void)
+{
+    struct sockaddr_un addr;
+    CFSocketRef        listener;
+    CFRunLoopSourceRef source;
+    int                fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    print_errmsg_if_err(strlen(lircPath) >= sizeof(addr.sun_path),
+                        "lircd socket path too long");
+    strcpy(addr.sun_path, lircPath);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    print_errmsg_if_err(fd < 0, "Failed to create lircd socket");
+    (void)unlink(lircPath);
+    print_errmsg_if_err(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+                        listen(fd, 16) < 0, "Failed to bind lircd socket");
+
+    listener = CFSocketCreateWithNative(NULL, fd, kCFSocketAcceptCallBack,
+                                        LircAcceptCallback, NULL);
+    source = CFSocketCreateRunLoopSource(NULL, listener, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+}
+
+/*
+ * Decode "<code> <repeat> <button> <remote>" in place. Replies to commands
+ * (BEGIN ... END blocks) are skipped.
+ */
+void
+lircInputLine(char *line)
+{
+    UInt64  code;
+    char   *p, *name;
+    long    repeat;
+    int     button;
+
+    if (lircInReply) {
+        lircInReply = (strcmp(line, "END") != 0);
+        return;
+    }
+    if (strcmp(line, "BEGIN") == 0) {
+        lircInReply = 1;
+        return;
+    }
+
+    code = strtoull(line, &p, 16);
+    if (p == line) {
+        lircInputUnknown++;
+        return;
+    }
+    repeat = strtol(p, &p, 16);
+    name = p + strspn(p, " \t");
+    name[strcspn(name, " \t")] = '\0';
+    if (*name == '\0') {
+        lircInputUnknown++;
+        return;
+    }
+
+    for (button = 0; button < NBUTTONS; button++)
+        if (strcmp(name, buttonNames[button]) == 0 ||
+            strcmp(name, lircButtonNames[button]) == 0)
+            break;
+    if (button == NBUTTONS) {
+        lircInputUnknown++;
+        return;
+    }
+
+    if (repeat) {
+        lircInputRepeats++;
+        // a hold lasts as long as its repeats keep coming
+        if (button == lircHeldButton)
+            CFRunLoopTimerSetNextFireDate(lircReleaseTimer,
+                CFAbsoluteTimeGetCurrent() + LIRC_RELEASE_GAP);
+        return;
+    }
+    lircInputPresses++;
+    if (!holdPassthrough) {
+        dispatchEvent(SOURCE_LIRC, (UInt32)code, button, 1, nanotime(), 0);
+        dispatchEvent(SOURCE_LIRC, (UInt32)code, button, 0, nanotime(), 0);
+        return;
+    }
+    lircRelease();
+    dispatchEvent(SOURCE_LIRC, (UInt32)code, button, 1, nanotime(), 0);
+    lircHeldButton = button;
+    lircHeldCode = (UInt32)code;
+    CFRunLoopTimerSetNextFireDate(lircReleaseTimer,
+                                  CFAbsoluteTimeGetCurrent() +
+                                  LIRC_RELEASE_GAP);
+}
+
+/*
+ * Dispatch the release of the button lircd last reported, if it is still
+ * considered held.
+ */
+void
+lircRelease(void)
+{
+    if (lircHeldButton == BUTTON_NONE)
+        return;
+    dispatchEvent(SOURCE_LIRC, lircHeldCode, lircHeldButton, 0, nanotime(),
+                  0);
+    lircHeldButton = BUTTON_NONE;
+    CFRunLoopTimerSetNextFireDate(lircReleaseTimer,
+                                  CFAbsoluteTimeGetCurrent() + 1e9);
+}
 
-void            usage(void);
-OSStatus        KeynoteChangeSlide(AEEventID eventID);
-void            print_errmsg_if_io_err(int expr, char *msg);
-void            print_errmsg_if_err(int expr, char *msg);
-void            QueueCallbackFunction(void *target, IOReturn result,
-                                      void *refcon, void *sender);
-bool            addQueueCallbacks(IOHIDQueueInterface **hqi);
-void            processQueue(IOHIDDeviceInterface **hidDeviceInterface,
-                             cookie_struct_t cookies);
-void            doRun(IOHIDDeviceInterface **hidDeviceInterface,
-                      cookie_struct_t cookies);
-cookie_struct_t getHIDCookies(IOHIDDeviceInterface122 **handle);
-void            createHIDDeviceInterface(io_object_t hidDevice,
-                                         IOHIDDeviceInterface ***hdi);
-void            setupAndRun(void);
+void
+LircReleaseCallback(CFRunLoopTimerRef timer, void *info)
+{
+    if (lircHeldButton != BUTTON_NONE)
+        lircInferredReleases++;
+    lircRelease();
+}
 
 void
-usage(void)
+lircInputDisconnect(void)
 {
-    printf("%s (version %s)\n", PROGNAME, PROGVERS);
-    printf("Copyright (c) 2006-2008 Amit Singh. All Rights Reserved.\n");
-    printf("Displays events received from the Apple Infrared Remote.\n\n");
-    printf("Keyboard arrow event extension (c) 2013 by Manuel Peuster <manuel@peuster.de>.\n\n");
-    printf("Usage: %s [OPTIONS...]\n\nOptions:\n", PROGNAME);
-    printf("  -h, --help    print this help message and exit\n");
-    printf("  -k, --keynote use forward/backward button presses for Keynote slide transition\n\n");
-    printf("  -a, --arrows use forward/backward/up/down button presses to generate the corresponding \n\t\tkeyboard arrow events (e.g. for Preview.app slide transition)\n\n");
-    printf("Please report bugs using the following contact information:\n"
-           "<URL:http://www.osxbook.com/software/bugs/>\n");
+    if (lircInputSocket) {
+        CFRunLoopRemoveSource(CFRunLoopGetCurrent(), lircInputSource,
+                              kCFRunLoopDefaultMode);
+        CFSocketInvalidate(lircInputSocket);
+        CFRelease(lircInputSource);
+        CFRelease(lircInputSocket);
+        lircInputSocket = NULL;
+        lircInputSource = NULL;
+    }
+    lircInputLength = 0;
+    lircInReply = 0;
+    lircRelease();
+
+    CFRunLoopTimerSetNextFireDate(lircReconnectTimer,
+                                  CFAbsoluteTimeGetCurrent() + lircBackoff);
+    lircBackoff *= 2;
+    if (lircBackoff > LIRC_BACKOFF_MAX)
+        lircBackoff = LIRC_BACKOFF_MAX;
 }
 
-OSStatus
-KeynoteChangeSlide(AEEventID eventID)
+void
+LircInputCallback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address,
+                  const void *data, void *info)
 {
-    OSStatus     err = noErr;
-    AppleEvent   eventToSend = { typeNull, nil };
-    AppleEvent   eventReply  = { typeNull, nil };
-    AEBuildError eventBuildError;
+    char    *line, *newline, *end;
+    ssize_t  n;
 
-    err = AEBuildAppleEvent(
-              keynoteEventClass,     // Event class for the resulting event
-              eventID,               // Event ID for the resulting event
-              typeApplicationBundleID,
-              keynoteID,
-              strlen(keynoteID),
-              kAutoGenerateReturnID, // Return ID for the created event
-              kAnyTransactionID,     // Transaction ID for this event
-              &eventToSend,          // Pointer to location for storing result
-              &eventBuildError,      // Pointer to error structure
-              "",                    // AEBuild format string describing the
-              NULL                   // AppleEvent record to be created
-        );
-    if (err != noErr) {
-        fprintf(stderr, "Failed to build Apple event (error %d).\n", (int)err);
-        return err;
+    n = read(CFSocketGetNative(s), lircInputBuffer + lircInputLength,
+             LIRC_INPUT_BUFFER - lircInputLength);
+    if (n < 0 && errno == EAGAIN)
+        return;
+    if (n <= 0) {
+        fprintf(stderr, "Lost connection to lircd at %s.\n", lircInputPath);
+        lircInputDisconnect();
+        return;
     }
+    lircInputLength += n;
 
-    err = AESend(&eventToSend,
-                 &eventReply,
-                 kAEWaitReply,      // send mode (wait for reply)
-                 kAENormalPriority,
-                 kNoTimeOut,
-                 nil,               // no pointer to idle function
-                 nil);              // no pointer to filter function
-    
-    if (err != noErr)
-        fprintf(stderr, "Failed to send Apple event (error %d).\n", (int)err);
+    line = lircInputBuffer;
+    end = lircInputBuffer + lircInputLength;
+    while ((newline = memchr(line, '\n', end - line)) != NULL) {
+        *newline = '\0';
+        lircInputLine(line);
+        line = newline + 1;
+    }
+    lircInputLength = end - line;
+    // a line longer than the whole buffer can only be garbage
+    if (lircInputLength == LIRC_INPUT_BUFFER)
+        lircInputLength = 0;
+    memmove(lircInputBuffer, line, lircInputLength);
+}
 
-    // Dispose of the send/reply descs
-    AEDisposeDesc(&eventToSend);
-    AEDisposeDesc(&eventReply);
+void
+LircReconnectCallback(CFRunLoopTimerRef timer, void *info)
+{
+    struct sockaddr_un addr;
+    int                fd;
 
-    return err;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, lircInputPath);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        lircInputDisconnect();
+        return;
+    }
+    // connecting to a Unix socket never blocks, so this can stay synchronous
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        lircInputDisconnect();
+        return;
+    }
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    lircInputSocket = CFSocketCreateWithNative(NULL, fd, kCFSocketReadCallBack,
+                                               LircInputCallback, NULL);
+    lircInputSource = CFSocketCreateRunLoopSource(NULL, lircInputSocket, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), lircInputSource,
+                       kCFRunLoopDefaultMode);
+    lircBackoff = LIRC_BACKOFF_MIN;
+    lircInputConnects++;
 }
 
 void
-print_errmsg_if_io_err(int expr, char *msg)
+startLircInput(void)
 {
-    IOReturn err = (expr);
+    print_errmsg_if_err(strlen(lircInputPath) >=
+                        sizeof(((struct sockaddr_un *)0)->sun_path),
+                        "lircd input socket path too long");
 
-    if (err != kIOReturnSuccess) {
-        fprintf(stderr, "*** %s - %s(%x, %d).\n", msg, mach_error_string(err),
-                err, err & 0xffffff);
-        fflush(stderr);
-        exit(EX_OSERR);
+    // fires only when a reconnect is scheduled
+    lircReconnectTimer = CFRunLoopTimerCreate(NULL,
+                             CFAbsoluteTimeGetCurrent() + 1e9, 1e9, 0, 0,
+                             LircReconnectCallback, NULL);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), lircReconnectTimer,
+                      kCFRunLoopDefaultMode);
+    if (holdPassthrough) {
+        // fires only while a press is held
+        lircReleaseTimer = CFRunLoopTimerCreate(NULL,
+                               CFAbsoluteTimeGetCurrent() + 1e9, 1e9, 0, 0,
+                               LircReleaseCallback, NULL);
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), lircReleaseTimer,
+                          kCFRunLoopDefaultMode);
     }
+    LircReconnectCallback(lircReconnectTimer, NULL);
 }
 
+/*
+ * Handle one button event from any source: log and journal it under a new
+ * trace ID, apply the button rate limit and hand the press to the sinks
+ * bound in the live keymap. Runs on the run loop thread only.
+ */
 void
-print_errmsg_if_err(int expr, char *msg)
+dispatchEvent(int source, UInt32 code, int button, SInt32 value,
+              UInt64 timestamp, UInt64 notBefore)
 {
-    if (expr) {
-        fprintf(stderr, "*** %s.\n", msg);
-        fflush(stderr);
-        exit(EX_OSERR);
+    keymap_entry_t  *entry;
+    history_event_t *e;
+    UInt64           trace, now;
+    int              k;
+
+    trace = ++lastTraceID;
+    if (source == SOURCE_IR)
+        printf("%#x %s (trace %llu)\n", (unsigned int)code,
+               (value == 0) ? "depressed" : "pressed", trace);
+    else
+        printf("%s %s %s (trace %llu)\n", sourceNames[source],
+               (button == BUTTON_NONE) ? "-" : buttonNames[button],
+               (value == 0) ? "depressed" : "pressed", trace);
+    if (journal)
+        fprintf(journal, "E %llu %llu %s %#x %s %d\n", trace, timestamp,
+                sourceNames[source], (unsigned int)code,
+                (button == BUTTON_NONE) ? "-" : buttonNames[button],
+                (int)value);
+    e = &history[historyNext++ % HISTORY_SIZE];
+    e->trace = trace;
+    e->timestamp = timestamp;
+    e->source = source;
+    e->button = button;
+    e->value = value;
+
+    // delivery latency of the first press after a pause; a press stamped
+    // before the last one is out of order and follows no pause
+    if (value && source == SOURCE_IR && timestamp > lastPressTime) {
+        if (lastPressTime && timestamp - lastPressTime >= PAUSE_GAP &&
+            (now = nanotime()) > timestamp) {
+            pauseCount[sessionActive]++;
+            pauseLatencyTotal[sessionActive] += now - timestamp;
+            if (now - timestamp > pauseLatencyMax[sessionActive])
+                pauseLatencyMax[sessionActive] = now - timestamp;
+        }
+        lastPressTime = timestamp;
+    }
+
+    if (value && button != BUTTON_NONE &&
+        rateLimitTake(&buttonLimits[button], nanotime(), &notBefore)) {
+        lircBroadcast(button, 0);
+        if (sessionTimeout &&
+            (cueCount || activeKeymap->map[button][SINK_ARROWS].action ||
+             activeKeymap->map[button][SINK_KEYNOTE].action))
+            sessionPress();
+        if (cueCount && button == BUTTON_NEXT)
+            cueGo(trace, timestamp, notBefore);
+        else if (cueCount && button == BUTTON_PREVIOUS) {
+            if (cueStandby > 0)
+                cueStandby--;
+        } else {
+            for (k = 0; k < NMAPPEDSINKS; k++) {
+                entry = &activeKeymap->map[button][k];
+                if (!entry->action)
+                    continue;
+                if (k == SINK_ARROWS && holdPassthrough) {
+                    // a press without its release still holds the key
+                    keyRelease(button, trace);
+                    if (sinkSubmit(k, trace, timestamp, notBefore,
+                                   entry->budget,
+                                   entry->action | KEY_DOWN_ONLY,
+                                   &heldNotBefore[button]))
+                        heldKeys[button] = entry->action;
+                } else
+                    sinkSubmit(k, trace, timestamp, notBefore, entry->budget,
+                               entry->action, NULL);
+            }
+            if (shadowEnabled)
+                sinkSubmit(SINK_SHADOW, trace, 0, 0, 0,
+                           ((activeApp + 1) << 8) | button, NULL);
+        }
     }
+    if (value == 0 && button != BUTTON_NONE)
+        keyRelease(button, trace);
+    if (!dispatchBatching)
+        dispatchFlush();
 }
 
 void
 QueueCallbackFunction(void *target, IOReturn result, void *refcon, void *sender)
 {
-    HRESULT               ret = 0;
     AbsoluteTime          zeroTime = {0,0};
-    IOHIDQueueInterface **hqi;
-    IOHIDEventStruct      event;
-
-    while (!ret) {
-        hqi = (IOHIDQueueInterface **)sender;
-        ret = (*hqi)->getNextEvent(hqi, &event, zeroTime, 0);
-        if (!ret) {
-            printf("%#x %s\n", (unsigned int)event.elementCookie,
-                   (event.value == 0) ? "depressed" : "pressed");
-            fflush(stdout);
-            if(event.value && driveKeyboardArrows) {
-                // select correct CGKeyCode
-                CGKeyCode keycode = 0;
-                if (event.elementCookie == buttonNextID)
-                    keycode = (CGKeyCode)124; // right
-                else if (event.elementCookie == buttonPreviousID)
-                    keycode = (CGKeyCode)123; // left
-                else if (event.elementCookie == buttonUpID)
-                    keycode = (CGKeyCode)126; // up
-                else if (event.elementCookie == buttonDownID)
-                    keycode = (CGKeyCode)125; // down
-                
-                if (keycode) {
-                    printf("Sending keystroke with CGKeyCode: %hu\n", keycode);
-                    // define events
-                    CGEventRef keyDown = CGEventCreateKeyboardEvent(NULL, keycode, true);
-                    CGEventRef keyUp = CGEventCreateKeyboardEvent(NULL, keycode, false);
-                    // send key down and up events
-                    CGEventPost(kCGAnnotatedSessionEventTap, keyDown);
-                    CGEventPost(kCGAnnotatedSessionEventTap, keyUp);
-                    // release resources
-                    CFRelease(keyUp);
-                    CFRelease(keyDown);
+    IOHIDQueueInterface **hqi = (IOHIDQueueInterface **)sender;
+    IOHIDEventStruct      events[EVENT_BATCH];
+    int                   buttons[EVENT_BATCH];
+    UInt64                timestamps[EVENT_BATCH];
+    int                   i, n, fetched;
+    IOHIDElementCookie    cookie;
+
+    do {
+        for (fetched = 0; fetched < EVENT_BATCH; fetched++)
+            if ((*hqi)->getNextEvent(hqi, &events[fetched], zeroTime, 0))
+                break;
+        if (fetched == 0)
+            break;
+
+        // drop reports that repeat the last value of an element that
+        // reports releases
+        for (i = n = 0; i < fetched; i++) {
+            cookie = events[i].elementCookie;
+            if (cookie < COOKIE_TABLE_SIZE) {
+                if (cookieTable[cookie].releases &&
+                    cookieTable[cookie].value == events[i].value) {
+                    unchangedReports++;
+                    continue;
                 }
+                cookieTable[cookie].value = events[i].value;
+                if (events[i].value == 0)
+                    cookieTable[cookie].releases = true;
             }
-            if (event.value && driveKeynote) {
-                if (event.elementCookie == buttonNextID)
-                    KeynoteChangeSlide(slideForward);
-                else if (event.elementCookie == buttonPreviousID)
-                    KeynoteChangeSlide(slideBackward);
-            }
+            events[n++] = events[i];
         }
-    }
+        for (i = 0; i < n; i++) {
+            buttons[i] = buttonIndex(events[i].elementCookie);
+            timestamps[i] = absoluteToNanos(events[i].timestamp);
+        }
+
+        dispatchBatching = 1;
+        for (i = 0; i < n; i++)
+            dispatchEvent(SOURCE_IR, events[i].elementCookie, buttons[i],
+                          events[i].value, timestamps[i], 0);
+        dispatchBatching = 0;
+        dispatchFlush();
+
+        eventBatches++;
+        batchedEvents += fetched;
+        if (fetched > largestBatch)
+            largestBatch = fetched;
+    } while (fetched == EVENT_BATCH);
 }
 
 bool
 addQueueCallbacks(IOHIDQueueInterface **hqi)
 {
-    IOReturn               ret;
-    CFRunLoopSourceRef     eventSource;
-    IOHIDQueueInterface ***privateData;
+    IOReturn ret;
 
-    privateData = malloc(sizeof(*privateData));
-    *privateData = hqi;
-
-    ret = (*hqi)->createAsyncEventSource(hqi, &eventSource);
+    ret = (*hqi)->createAsyncEventSource(hqi, &hidQueueSource);
     if (ret != kIOReturnSuccess)
         return false;
 
-    ret = (*hqi)->setEventCallout(hqi, QueueCallbackFunction,
-                                  NULL, &privateData);
+    // the callback finds the queue through its sender argument
+    ret = (*hqi)->setEventCallout(hqi, QueueCallbackFunction, NULL, NULL);
     if (ret != kIOReturnSuccess)
         return false;
 
-    CFRunLoopAddSource(CFRunLoopGetCurrent(), eventSource,
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), hidQueueSource,
                        kCFRunLoopDefaultMode);
     return true;
 }
 
-void
+IOHIDQueueInterface **
 processQueue(IOHIDDeviceInterface **hidDeviceInterface, cookie_struct_t cookies)
 {
-    HRESULT               result;
     IOHIDQueueInterface **queue;
 
     queue = (*hidDeviceInterface)->allocQueue(hidDeviceInterface);
     if (!queue) {
         fprintf(stderr, "Failed to allocate event queue.\n");
-        return;
+        return NULL;
     }
 
-    (void)(*queue)->create(queue, 0, 8);
+    (void)(*queue)->create(queue, 0, EVENT_BATCH);
 
     (void)(*queue)->addElement(queue,
                                cookies->gButtonCookie_SystemAppMenu, 0);
@@ -292,35 +4701,281 @@ processQueue(IOHIDDeviceInterface **hidDeviceInterface, cookie_struct_t cookies)
 
     addQueueCallbacks(queue);
 
-    result = (*queue)->start(queue);
-    
-    CFRunLoopRun();
+    (void)(*queue)->start(queue);
+
+    return queue;
+}
+
+void
+stopQueue(IOHIDQueueInterface **queue)
+{
+    (void)(*queue)->stop(queue);
 
-    result = (*queue)->stop(queue);
+    if (hidQueueSource) {
+        CFRunLoopRemoveSource(CFRunLoopGetCurrent(), hidQueueSource,
+                              kCFRunLoopDefaultMode);
+        // createAsyncEventSource() hands over a reference
+        CFRelease(hidQueueSource);
+        hidQueueSource = NULL;
+    }
 
-    result = (*queue)->dispose(queue);
+    (void)(*queue)->dispose(queue);
 
     (*queue)->Release(queue);
 }
 
+/*
+ * Open the receiver and start its event queue. The element map is parsed
+ * on the first attach only; cookies do not change across sleep, so a
+ * reattach after wake reuses it.
+ */
+bool
+attachDevice(void)
+{
+    CFMutableDictionaryRef hidMatchDictionary = NULL;
+    io_service_t           hidService = (io_service_t)0;
+    IOReturn               ioReturnValue = kIOReturnSuccess;
+
+    hidMatchDictionary = IOServiceNameMatching("AppleIRController");
+    hidService = IOServiceGetMatchingService(kIOMasterPortDefault,
+                                             hidMatchDictionary);
+    if (!hidService)
+        return false;
+
+    hidDeviceInterface = NULL;
+    createHIDDeviceInterface((io_object_t)hidService, &hidDeviceInterface);
+    if (!hidCookies && hidDeviceInterface)
+        hidCookies =
+            getHIDCookies((IOHIDDeviceInterface122 **)hidDeviceInterface);
+    ioReturnValue = IOObjectRelease(hidService);
+    print_errmsg_if_io_err(ioReturnValue, "Failed to release HID.");
+
+    if (hidDeviceInterface == NULL)
+        return false;
+
+    hidDeviceOpen = ((*hidDeviceInterface)->open(hidDeviceInterface, 0) ==
+                     kIOReturnSuccess);
+
+    if ((hidQueue = processQueue(hidDeviceInterface, hidCookies)) == NULL) {
+        detachDevice();
+        return false;
+    }
+
+    return true;
+}
+
+void
+detachDevice(void)
+{
+    int i;
+
+    if (hidQueue) {
+        stopQueue(hidQueue);
+        hidQueue = NULL;
+    }
+    if (hidDeviceInterface) {
+        if (hidDeviceOpen)
+            (void)(*hidDeviceInterface)->close(hidDeviceInterface);
+        (*hidDeviceInterface)->Release(hidDeviceInterface);
+        hidDeviceInterface = NULL;
+        hidDeviceOpen = false;
+    }
+
+    // element values are unknown until the device reports again
+    for (i = 0; i < COOKIE_TABLE_SIZE; i++)
+        cookieTable[i].value = -1;
+}
+
+/*
+ * Park the periodic timers while the machine sleeps, so they don't all fire
+ * at once on wake and compete with the reattach.
+ */
+void
+suspendTimers(bool suspend)
+{
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+
+    if (statsTimer)
+        CFRunLoopTimerSetNextFireDate(statsTimer,
+                                      suspend ? now + 1e9 : now + statsInterval);
+    if (lircReconnectTimer && !lircInputSocket)
+        CFRunLoopTimerSetNextFireDate(lircReconnectTimer,
+                                      suspend ? now + 1e9 : now);
+}
+
+void
+reattach(void)
+{
+    if (hidQueue || !receiverUsed)
+        return;
+
+    if (!attachDevice()) {
+        reattachFailures++;
+        CFRunLoopTimerSetNextFireDate(reattachTimer,
+                                      CFAbsoluteTimeGetCurrent() +
+                                      REATTACH_RETRY);
+        return;
+    }
+
+    if (wakeTime) {
+        lastResumeReady = nanotime() - wakeTime;
+        wakeTime = 0;
+        fprintf(stderr, "Receiver ready %.1f ms after wake.\n",
+                lastResumeReady / 1e6);
+        fflush(stderr);
+    }
+}
+
+void
+ReattachTimerCallback(CFRunLoopTimerRef timer, void *info)
+{
+    reattach();
+}
+
+void
+PowerCallback(void *refcon, io_service_t service, natural_t messageType,
+              void *messageArgument)
+{
+    switch (messageType) {
+    case kIOMessageCanSystemSleep:
+        IOAllowPowerChange(powerPort, (long)messageArgument);
+        break;
+    case kIOMessageSystemWillSleep:
+        sleepCount++;
+        if (sessionTimer)
+            sessionEnd();
+        // the receiver is closed, so its releases would be lost
+        lircRelease();
+        releaseKeys();
+        dispatchFlush();
+        if (holdPassthrough)
+            checkKeysUp();
+        suspendTimers(true);
+        CFRunLoopTimerSetNextFireDate(reattachTimer,
+                                      CFAbsoluteTimeGetCurrent() + 1e9);
+        detachDevice();
+        IOAllowPowerChange(powerPort, (long)messageArgument);
+        break;
+    case kIOMessageSystemWillPowerOn:
+        // earliest wake notification; the receiver may not be back yet
+        wakeTime = nanotime();
+        reattach();
+        break;
+    case kIOMessageSystemHasPoweredOn:
+        if (!wakeTime && !hidQueue)
+            wakeTime = nanotime();
+        suspendTimers(false);
+        reattach();
+        break;
+    }
+}
+
+void
+sessionBegin(void)
+{
+    thread_time_constraint_policy_data_t policy;
+    kern_return_t                        kr;
+    IOReturn                             ret;
+
+    policy.period = 0;
+    policy.computation = (uint32_t)nanosToTicks(SESSION_COMPUTATION);
+    policy.constraint = (uint32_t)nanosToTicks(SESSION_CONSTRAINT);
+    policy.preemptible = 1;
+    kr = thread_policy_set(runLoopThread, THREAD_TIME_CONSTRAINT_POLICY,
+                           (thread_policy_t)&policy,
+                           THREAD_TIME_CONSTRAINT_POLICY_COUNT);
+    if (kr != KERN_SUCCESS)
+        report_error(lastTraceID, "Failed to raise the input thread", kr);
+    ret = IOPMAssertionCreateWithName(kIOPMAssertPreventUserIdleSystemSleep,
+                                      kIOPMAssertionLevelOn,
+                                      CFSTR("iremoted presentation session"),
+                                      &sessionAssertion);
+    if (ret != kIOReturnSuccess) {
+        report_error(lastTraceID, "Failed to create power assertion", ret);
+        sessionAssertion = 0;
+    }
+    sessionActive = 1;
+    sessionCount++;
+}
+
+void
+sessionEnd(void)
+{
+    thread_standard_policy_data_t policy;
+
+    if (!sessionActive)
+        return;
+    (void)thread_policy_set(runLoopThread, THREAD_STANDARD_POLICY,
+                            (thread_policy_t)&policy,
+                            THREAD_STANDARD_POLICY_COUNT);
+    if (sessionAssertion)
+        (void)IOPMAssertionRelease(sessionAssertion);
+    sessionAssertion = 0;
+    sessionActive = 0;
+    CFRunLoopTimerSetNextFireDate(sessionTimer,
+                                  CFAbsoluteTimeGetCurrent() + 1e9);
+}
+
+/*
+ * A mapped press starts a session or pushes its end out.
+ */
+void
+sessionPress(void)
+{
+    if (!sessionActive)
+        sessionBegin();
+    CFRunLoopTimerSetNextFireDate(sessionTimer,
+                                  CFAbsoluteTimeGetCurrent() + sessionTimeout);
+}
+
+void
+SessionTimerCallback(CFRunLoopTimerRef timer, void *info)
+{
+    sessionEnd();
+}
+
 void
-doRun(IOHIDDeviceInterface **hidDeviceInterface, cookie_struct_t cookies)
+startSessions(void)
 {
-    IOReturn ioReturnValue;
+    runLoopThread = pthread_mach_thread_np(pthread_self());
 
-    ioReturnValue = (*hidDeviceInterface)->open(hidDeviceInterface, 0);
+    // fires only while a session is active
+    sessionTimer = CFRunLoopTimerCreate(NULL, CFAbsoluteTimeGetCurrent() + 1e9,
+                                        1e9, 0, 0, SessionTimerCallback, NULL);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), sessionTimer,
+                      kCFRunLoopDefaultMode);
+}
 
-    processQueue(hidDeviceInterface, cookies);
+void
+startPower(void)
+{
+    powerPort = IORegisterForSystemPower(NULL, &powerNotifyPort,
+                                         PowerCallback, &powerNotifier);
+    if (powerPort == MACH_PORT_NULL) {
+        fprintf(stderr, "Failed to register for sleep notifications.\n");
+        return;
+    }
+    CFRunLoopAddSource(CFRunLoopGetCurrent(),
+                       IONotificationPortGetRunLoopSource(powerNotifyPort),
+                       kCFRunLoopDefaultMode);
 
-    if (ioReturnValue == KERN_SUCCESS)
-        ioReturnValue = (*hidDeviceInterface)->close(hidDeviceInterface);
-    (*hidDeviceInterface)->Release(hidDeviceInterface);
+    // fires only while a reattach after wake is pending
+    reattachTimer = CFRunLoopTimerCreate(NULL, CFAbsoluteTimeGetCurrent() + 1e9,
+                                         1e9, 0, 0, ReattachTimerCallback,
+                                         NULL);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), reattachTimer,
+                      kCFRunLoopDefaultMode);
 }
 
+/*
+ * The element map is parsed once per process, so it lives in static
+ * storage rather than on the heap.
+ */
 cookie_struct_t
 getHIDCookies(IOHIDDeviceInterface122 **handle)
 {
-    cookie_struct_t    cookies;
+    static struct cookie_struct storage;
+    cookie_struct_t    cookies = &storage;
     IOHIDElementCookie cookie;
     CFTypeRef          object;
     long               number;
@@ -330,15 +4985,12 @@ getHIDCookies(IOHIDDeviceInterface122 **handle)
     CFDictionaryRef    element;
     IOReturn           result;
 
-    if ((cookies = (cookie_struct_t)malloc(sizeof(*cookies))) == NULL) {
-        fprintf(stderr, "Failed to allocate cookie memory.\n");
-        exit(1);
-    }
-
     memset(cookies, 0, sizeof(*cookies));
 
-    if (!handle || !(*handle))
+    if (!handle || !(*handle)) {
+        compileCookieTable();
         return cookies;
+    }
 
     result = (*handle)->copyMatchingElements(handle, NULL, &elements);
 
@@ -372,9 +5024,11 @@ getHIDCookies(IOHIDDeviceInterface122 **handle)
         if (usagePage == kHIDPage_GenericDesktop) {
             switch (usage) {
             case kHIDUsage_GD_SystemAppMenu:
+                buttonMenuID = cookie;
                 cookies->gButtonCookie_SystemAppMenu = cookie;
                 break;
             case kHIDUsage_GD_SystemMenu:
+                buttonSelectID = cookie;
                 cookies->gButtonCookie_SystemMenuSelect = cookie;
                 break;
             case kHIDUsage_GD_SystemMenuRight:
@@ -396,6 +5050,9 @@ getHIDCookies(IOHIDDeviceInterface122 **handle)
             }
         }
     }
+    CFRelease(elements);
+
+    compileCookieTable();
 
     return cookies;
 }
@@ -433,51 +5090,73 @@ createHIDDeviceInterface(io_object_t hidDevice, IOHIDDeviceInterface ***hdi)
     (*plugInInterface)->Release(plugInInterface);
 }
 
+/*
+ * Every client is a descriptor, and processes start with only 256. Allow
+ * enough for all pools at their limits, plus some for everything else.
+ */
 void
-setupAndRun(void)
+raiseFileLimit(void)
 {
-    CFMutableDictionaryRef hidMatchDictionary = NULL;
-    io_service_t           hidService = (io_service_t)0;
-    io_object_t            hidDevice = (io_object_t)0;
-    IOHIDDeviceInterface **hidDeviceInterface = NULL;
-    IOReturn               ioReturnValue = kIOReturnSuccess;
-    cookie_struct_t        cookies;
-    
-    hidMatchDictionary = IOServiceNameMatching("AppleIRController");
-    hidService = IOServiceGetMatchingService(kIOMasterPortDefault,
-                                             hidMatchDictionary);
+    struct rlimit files;
+    rlim_t        wanted = controlPool.limit + websocketPool.limit +
+                           lircPool.limit + 64;
 
-    if (!hidService) {
-        fprintf(stderr, "Apple Infrared Remote not found.\n");
-        exit(1);
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < wanted) {
+        files.rlim_cur = (files.rlim_max < wanted) ? files.rlim_max : wanted;
+        (void)setrlimit(RLIMIT_NOFILE, &files);
     }
+}
 
-    hidDevice = (io_object_t)hidService;
-
-    createHIDDeviceInterface(hidDevice, &hidDeviceInterface);
-    cookies = getHIDCookies((IOHIDDeviceInterface122 **)hidDeviceInterface);
-    ioReturnValue = IOObjectRelease(hidDevice);
-    print_errmsg_if_io_err(ioReturnValue, "Failed to release HID.");
-
-    if (hidDeviceInterface == NULL) {
-        fprintf(stderr, "No HID.\n");
-        exit(1);
+void
+setupAndRun(void)
+{
+    // lircd decodes the receiver itself, and WebSocket clients need none
+    if (lircInputPath)
+        receiverUsed = false;
+    else if (!attachDevice()) {
+        if (!websocketPort) {
+            fprintf(stderr, "Apple Infrared Remote not found.\n");
+            exit(1);
+        }
+        fprintf(stderr, "Apple Infrared Remote not found, "
+                "using WebSocket clients only.\n");
+        receiverUsed = false;
     }
 
-    ioReturnValue = (*hidDeviceInterface)->open(hidDeviceInterface, 0);
+    if (statsInterval > 0) {
+        statsTimer = CFRunLoopTimerCreate(NULL,
+                         CFAbsoluteTimeGetCurrent() + statsInterval,
+                         statsInterval, 0, 0, StatsTimerCallback, NULL);
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), statsTimer,
+                          kCFRunLoopDefaultMode);
+    }
 
-    doRun(hidDeviceInterface, cookies);
+    raiseFileLimit();
+    // the receiver is attached, so the probe must not hold up its events
+    if (injectAuto && !startProbe())
+        probeKeyboard(stderr);
+    if (controlPath)
+        startControl();
+    if (websocketPort)
+        startWebSocket();
+    if (lircPath)
+        startLirc();
+    if (lircInputPath)
+        startLircInput();
+    startPower();
+    if (sessionTimeout)
+        startSessions();
+    startFocusTracking();
 
-    if (ioReturnValue == KERN_SUCCESS)
-        ioReturnValue = (*hidDeviceInterface)->close(hidDeviceInterface);
+    CFRunLoopRun();
 
-    (*hidDeviceInterface)->Release(hidDeviceInterface);
+    detachDevice();
 }
 
 int
 main (int argc, char **argv)
 {
-    int c, option_index = 0;
+    int c, i, option_index = 0, keymapLoaded = 0;
 
     while ((c = getopt_long(argc, argv, options, long_options, &option_index))
          != -1) {
@@ -492,6 +5171,100 @@ main (int argc, char **argv)
         case 'a':
             driveKeyboardArrows = 1;
             break;
+        case 'H':
+            holdPassthrough = 1;
+            break;
+        case 's':
+            statsInterval = atoi(optarg);
+            break;
+        case 'w':
+            workerCount = atoi(optarg);
+            break;
+        case 'r':
+            parseRateLimit(optarg);
+            break;
+        case 'p':
+            if (strcmp(optarg, "drop") == 0)
+                ratePolicy = RATE_DROP;
+            else if (strcmp(optarg, "coalesce") == 0)
+                ratePolicy = RATE_COALESCE;
+            else if (strcmp(optarg, "delay") == 0)
+                ratePolicy = RATE_DELAY;
+            else {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'd':
+            parseDeadline(optarg);
+            break;
+        case 'm':
+            loadKeymap(optarg, &liveKeymap, appKeymaps);
+            keymapLoaded = 1;
+            break;
+        case 'M':
+            loadKeymap(optarg, &shadowKeymap, shadowAppKeymaps);
+            shadowEnabled = 1;
+            break;
+        case 'q':
+            loadCues(optarg);
+            break;
+        case 'P':
+            sessionTimeout = atof(optarg);
+            if (sessionTimeout <= 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'T':
+            print_errmsg_if_err(roomCount == MAX_ROOMS, "Too many journals");
+            roomPaths[roomCount++] = optarg;
+            break;
+        case 'b':
+            if (sscanf(optarg, "%d/%d", &benchRounds, &benchLoad) < 1 ||
+                benchRounds <= 0 || benchLoad < 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'i':
+            injectAuto = (strcmp(optarg, "auto") == 0);
+            for (i = 0; i < NINJECTS && !injectAuto; i++)
+                if (strcmp(optarg, injectNames[i]) == 0)
+                    break;
+            if (i == NINJECTS) {
+                usage();
+                exit(1);
+            }
+            if (!injectAuto)
+                atomic_store(&injectPoint, i);
+            break;
+        case 'c':
+            controlPath = optarg;
+            break;
+        case 'l':
+            lircPath = optarg;
+            break;
+        case 'L':
+            lircInputPath = optarg;
+            break;
+        case 'W':
+            websocketPort = atoi(optarg);
+            if (websocketPort <= 0 || websocketPort > 65535) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'O':
+            print_errmsg_if_err(websocketOriginCount == MAX_ORIGINS,
+                                "Too many origins");
+            websocketOrigins[websocketOriginCount++] = optarg;
+            break;
+        case 'j':
+            journal = fopen(optarg, "a");
+            print_errmsg_if_err(journal == NULL, "Failed to open journal");
+            setvbuf(journal, NULL, _IOLBF, 0);
+            break;
         default:
             usage();
             exit(1);
@@ -499,6 +5272,32 @@ main (int argc, char **argv)
         }
     }
 
+    // a keymap file replaces the built-in bindings, it does not extend them
+    if (keymapLoaded && (driveKeyboardArrows || driveKeynote)) {
+        fprintf(stderr, "-m cannot be combined with -a or -k.\n");
+        exit(1);
+    }
+    // the benchmark brings its own lircd input
+    if (benchRounds && lircInputPath) {
+        fprintf(stderr, "-b cannot be combined with -L.\n");
+        exit(1);
+    }
+    if (!keymapLoaded)
+        defaultKeymap(&liveKeymap);
+    finishKeymaps();
+    if (roomCount) {
+        tuneJournals(stdout);
+        exit(0);
+    }
+    prepareKeyboard();
+    prepareKeynote();
+    startWorkers();
+    if (benchRounds) {
+        if (injectAuto)
+            probeKeyboard(stderr);
+        benchInjection(stdout);
+        exit(0);
+    }
     setupAndRun();
 
     return 0;